@@ -0,0 +1,62 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#ifndef BENCH_H_
+#define BENCH_H_ 1
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Helpers shared by the micro-benchmarks. Name sets can be
+ * written by lxgraph itself with --names-out, one per line */
+
+#define DEFAULT_COUNT 1000000
+
+inline static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+inline static char *generate_name(size_t i) {
+    /* Looks like a typical display name of a kernel function */
+    static const char *prefixes[] = { "ext4", "btrfs", "xfs", "nfs", "tcp", "udp", "drm", "usb", "pci", "kvm" };
+    static const char *verbs[] = { "alloc", "free", "init", "exit", "get", "put", "lookup", "update", "flush", "submit" };
+    char buf[128];
+    snprintf(buf, sizeof buf, "%s_%s_%zx(struct %s_context *, unsigned long, int)",
+             prefixes[i % 10], verbs[i / 10 % 10], i, prefixes[i / 100 % 10]);
+    return strdup(buf);
+}
+
+/* Reads names from path or generates them if it is NULL */
+inline static size_t load_names(const char *path, char ***names) {
+    size_t count = 0, caps = 0;
+    *names = NULL;
+
+    if (!path) {
+        *names = malloc(DEFAULT_COUNT * sizeof **names);
+        for (; count < DEFAULT_COUNT; count++)
+            (*names)[count] = generate_name(count);
+        return count;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (!in) die("Cannot open '%s'", path);
+
+    char *line = NULL;
+    size_t len = 0;
+    for (ssize_t res; (res = getline(&line, &len, in)) > 0; ) {
+        if (line[res - 1] == '\n') line[res - 1] = '\0';
+        if (!adjust_buffer((void **)names, &caps, count + 1, sizeof **names)) die("Out of memory");
+        (*names)[count++] = strdup(line);
+    }
+
+    free(line);
+    fclose(in);
+    return count;
+}
+
+#endif
@@ -0,0 +1,156 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "util.h"
+#include "hashtable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compares string hashes on function names. Names are read from
+ * the file given as the first argument or generated. For each hash
+ * throughput is measured for all names and for names grouped by
+ * length, then names are distributed over the buckets of a chained
+ * table sized like ht_reserve() does, and chain lengths are shown
+ * with the number of full 64-bit collisions. */
+
+/* Bytes hashed by each throughput measurement */
+#define TARGET_BYTES (256 << 20)
+#define MAX_CHAIN 8
+
+struct hash_fn {
+    const char *name;
+    uint64_t (*fn)(const void *data, size_t len, uint64_t seed);
+};
+
+static const struct hash_fn hashes[] = {
+    { "murmur64", murmur64_seed },
+    { "wyhash", wyhash64_seed },
+};
+
+struct name {
+    const char *str;
+    size_t len;
+};
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+    return (ua > ub) - (ua < ub);
+}
+
+static void throughput(const struct hash_fn *hash, const char *group, struct name *names, size_t count) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) bytes += names[i].len;
+    if (!bytes) return;
+
+    size_t rounds = MAX(1, TARGET_BYTES / bytes);
+    volatile uint64_t sink = 0;
+    uint64_t acc = 0;
+
+    double start = now();
+    for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < count; i++)
+            acc ^= hash->fn(names[i].str, names[i].len, 123);
+    double time = now() - start;
+    sink = acc;
+    (void)sink;
+
+    printf("%-10s %-10s %9zu names %6.1f bytes %8.2f ns/name %8.1f MiB/s\n", hash->name, group, count,
+           (double)bytes / count, time * 1e9 / (rounds * count), rounds * bytes / time / (1 << 20));
+}
+
+static void distribution(const struct hash_fn *hash, struct name *names, size_t count) {
+    size_t caps = HT_LOAD_FACTOR(count);
+    uint32_t *chains = calloc(caps, sizeof *chains);
+    uint64_t *values = malloc(count * sizeof *values);
+
+    for (size_t i = 0; i < count; i++) {
+        values[i] = hash->fn(names[i].str, names[i].len, 123);
+        chains[values[i] % caps]++;
+    }
+
+    size_t histogram[MAX_CHAIN + 1] = { 0 }, longest = 0;
+    double probes = 0;
+    for (size_t i = 0; i < caps; i++) {
+        histogram[MIN(chains[i], MAX_CHAIN)]++;
+        longest = MAX(longest, chains[i]);
+        /* Successful lookups of all elements of the chain */
+        probes += chains[i] * (chains[i] + 1.) / 2;
+    }
+
+    /* Names are unique, so equal hashes are collisions */
+    size_t collisions = 0;
+    qsort(values, count, sizeof *values, cmp_u64);
+    for (size_t i = 1; i < count; i++)
+        collisions += values[i] == values[i - 1];
+
+    /* Uniform hash gives 1 + load / 2 */
+    printf("%-10s %zu buckets, %.2f probes/hit (ideal %.2f), longest chain %zu, %zu collisions\n",
+           hash->name, caps, probes / count, 1 + (double)count / caps / 2, longest, collisions);
+    for (size_t i = 0; i <= MAX_CHAIN; i++)
+        printf("%-10s chain %zu%s %10zu buckets\n", hash->name, i, i == MAX_CHAIN ? "+" : " ", histogram[i]);
+
+    free(values);
+    free(chains);
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(((const struct name *)a)->str, ((const struct name *)b)->str);
+}
+
+int main(int argc, char **argv) {
+    char **strings;
+    size_t nstrings = load_names(argc > 1 ? argv[1] : NULL, &strings);
+    if (!nstrings) die("No names");
+
+    /* Names dumps may contain duplicates */
+    struct name *names = malloc(nstrings * sizeof *names);
+    for (size_t i = 0; i < nstrings; i++)
+        names[i] = (struct name) { .str = strings[i], .len = strlen(strings[i]) };
+    qsort(names, nstrings, sizeof *names, cmp_name);
+    size_t count = 0;
+    for (size_t i = 0; i < nstrings; i++)
+        if (!count || strcmp(names[count - 1].str, names[i].str))
+            names[count++] = names[i];
+
+    /* Names are packed together, so that throughput
+     * is not dominated by cache misses */
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) total += names[i].len + 1;
+    char *packed = malloc(total), *next = packed;
+    for (size_t i = 0; i < count; i++) {
+        names[i].str = memcpy(next, names[i].str, names[i].len + 1);
+        next += names[i].len + 1;
+    }
+
+    /* Groups match the code paths of the hashes */
+    struct name *groups[3];
+    size_t group_size[3] = { 0 };
+    static const char *group_names[3] = { "<=16", "17..48", ">48" };
+    for (size_t g = 0; g < 3; g++) groups[g] = malloc(count * sizeof *names);
+    for (size_t i = 0; i < count; i++) {
+        size_t g = names[i].len <= 16 ? 0 : names[i].len <= 48 ? 1 : 2;
+        groups[g][group_size[g]++] = names[i];
+    }
+
+    printf("%zu names\n", count);
+
+    for (size_t h = 0; h < sizeof hashes / sizeof *hashes; h++) {
+        throughput(&hashes[h], "all", names, count);
+        for (size_t g = 0; g < 3; g++)
+            throughput(&hashes[h], group_names[g], groups[g], group_size[g]);
+    }
+
+    for (size_t h = 0; h < sizeof hashes / sizeof *hashes; h++)
+        distribution(&hashes[h], names, count);
+
+    for (size_t g = 0; g < 3; g++) free(groups[g]);
+    for (size_t i = 0; i < nstrings; i++) free(strings[i]);
+    free(strings);
+    free(packed);
+    free(names);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "util.h"
+#include "list.h"
+#include "hashtable.h"
+#include "swisstable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compares chained and open addressing hashtables on function names.
+ * Names are read from the file given as the first argument, one
+ * per line, or generated if there is none. Every table is filled,
+ * then all names are looked up in random order and then the same
+ * number of names which are not present in the table. */
+
+struct entry {
+    ht_head_t head;
+    const char *name;
+};
+
+static bool eq_entry(const ht_head_t *a, const ht_head_t *b) {
+    const struct entry *ae = container_of(a, const struct entry, head);
+    const struct entry *be = container_of(b, const struct entry, head);
+    return !strcmp(ae->name, be->name);
+}
+
+static void report(const char *table, const char *op, double time, size_t count) {
+    printf("%-12s %-14s %8.1f ns/op\n", table, op, time * 1e9 / count);
+}
+
+static void report_max(const char *table, const char *op, double time) {
+    printf("%-12s %-14s %8.1f us\n", table, op, time * 1e6);
+}
+
+int main(int argc, char **argv) {
+    char **names;
+    size_t count = load_names(argc > 1 ? argv[1] : NULL, &names);
+    if (!count) die("No names");
+
+    struct entry *entries = calloc(count, sizeof *entries);
+    struct entry *misses = calloc(count, sizeof *misses);
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        entries[i] = (struct entry) { .head.hash = hash64(names[i], len), .name = names[i] };
+        /* Same length, but different contents */
+        char *miss = strdup(names[i]);
+        miss[len / 2] ^= 0x20;
+        misses[i] = (struct entry) { .head.hash = hash64(miss, len), .name = miss };
+    }
+
+    /* Lookups are done in random order, like in the real graph */
+    size_t *order = malloc(count * sizeof *order);
+    uint64_t state = 1;
+    for (size_t i = 0; i < count; i++) order[i] = i;
+    for (size_t i = count - 1; i > 0; i--) {
+        state = uint_hash64(state + i);
+        size_t j = state % (i + 1);
+        SWAP(order[i], order[j]);
+    }
+
+    printf("%zu names\n", count);
+
+    size_t found = 0;
+    double start;
+
+    /* Chained table */
+    struct hashtable ht;
+    ht_init(&ht, HT_INIT_CAPS, eq_entry);
+
+    /* Slowest insertion shows the cost of resizing */
+    double worst = 0, total = 0;
+    for (size_t i = 0; i < count; i++) {
+        start = now();
+        ht_head_t **h = ht_lookup_ptr(&ht, &entries[i].head);
+        if (!*h) ht_insert_hint(&ht, h, &entries[i].head);
+        double time = now() - start;
+        worst = MAX(worst, time);
+        total += time;
+    }
+    report("chained", "insert", total, count);
+    report_max("chained", "max insert", worst);
+
+    start = now();
+    for (size_t i = 0; i < count; i++)
+        found += ht_find(&ht, &entries[order[i]].head) != NULL;
+    report("chained", "lookup hit", now() - start, count);
+
+    start = now();
+    for (size_t i = 0; i < count; i++)
+        found += ht_find(&ht, &misses[order[i]].head) != NULL;
+    report("chained", "lookup miss", now() - start, count);
+
+    ht.size = 0;
+    ht_free(&ht);
+
+    /* Same, but with the size known upfront */
+    ht_init(&ht, HT_INIT_CAPS, eq_entry);
+    ht_reserve(&ht, count);
+
+    start = now();
+    for (size_t i = 0; i < count; i++) {
+        ht_head_t **h = ht_lookup_ptr(&ht, &entries[i].head);
+        if (!*h) ht_insert_hint(&ht, h, &entries[i].head);
+    }
+    report("chained", "reserved", now() - start, count);
+
+    ht.size = 0;
+    ht_free(&ht);
+
+    /* Open addressing table */
+    struct swisstable sw;
+    if (!sw_init(&sw, SW_INIT_CAPS, eq_entry)) die("Out of memory");
+
+    worst = total = 0;
+    for (size_t i = 0; i < count; i++) {
+        start = now();
+        ht_head_t **h = sw_lookup_ptr(&sw, &entries[i].head);
+        if (!*h) sw_insert_hint(&sw, h, &entries[i].head);
+        double time = now() - start;
+        worst = MAX(worst, time);
+        total += time;
+    }
+    report("swisstable", "insert", total, count);
+    report_max("swisstable", "max insert", worst);
+
+    start = now();
+    for (size_t i = 0; i < count; i++)
+        found += sw_find(&sw, &entries[order[i]].head) != NULL;
+    report("swisstable", "lookup hit", now() - start, count);
+
+    start = now();
+    for (size_t i = 0; i < count; i++)
+        found += sw_find(&sw, &misses[order[i]].head) != NULL;
+    report("swisstable", "lookup miss", now() - start, count);
+
+    sw.size = 0;
+    sw_free(&sw);
+
+    /* Keeps lookups from being optimized out */
+    if (found > 2 * count) puts("Unexpected matches");
+
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+        free((char *)misses[i].name);
+    }
+    free(names);
+    free(order);
+    free(entries);
+    free(misses);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "util.h"
+#include "hashtable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compares sorting call sites of a function with qsort() and
+ * a comparator against sorting packed keys with sort_items(),
+ * as collapse_duplicates() does. Sites are generated for lists
+ * of different lengths, since most functions have few calls
+ * and few have thousands of them. Results are checked to match */
+
+#define TOTAL_SITES (1 << 22)
+
+struct site {
+    uint32_t callee;
+    int32_t line;
+    int32_t column;
+    float weight;
+};
+
+static int cmp_site(const void *a, const void *b) {
+    const struct site *site_a = a;
+    const struct site *site_b = b;
+
+    if (site_a->callee < site_b->callee) return -1;
+    if (site_a->callee > site_b->callee) return 1;
+
+    if (site_a->line < site_b->line) return -1;
+    if (site_a->line > site_b->line) return 1;
+
+    if (site_a->column < site_b->column) return -1;
+    if (site_a->column > site_b->column) return 1;
+
+    return 0;
+}
+
+static void generate(struct site *sites, size_t n, uint64_t *state) {
+    /* Calls mostly go to a few callees, from nearby lines */
+    uint32_t ncallees = n / 4 + 1;
+    for (size_t i = 0; i < n; i++) {
+        *state = uint_hash64(*state + i);
+        sites[i] = (struct site) {
+            .callee = *state % ncallees * 7919,
+            .line = 100 + (*state >> 20) % (n * 2 + 10),
+            .column = (*state >> 40) % 80,
+            .weight = 1,
+        };
+    }
+}
+
+static void run(size_t n) {
+    size_t count = TOTAL_SITES / n;
+    struct site *orig = malloc(TOTAL_SITES * sizeof *orig);
+    struct site *sorted = malloc(TOTAL_SITES * sizeof *sorted);
+    struct site *packed = malloc(TOTAL_SITES * sizeof *packed);
+    struct sort_item *items = malloc(n * sizeof *items);
+    struct sort_item *tmp = malloc(n * sizeof *tmp);
+    uint64_t state = n;
+
+    for (size_t i = 0; i < count; i++)
+        generate(orig + i * n, n, &state);
+
+    memcpy(sorted, orig, count * n * sizeof *sorted);
+    double start = now();
+    for (size_t i = 0; i < count; i++)
+        qsort(sorted + i * n, n, sizeof *sorted, cmp_site);
+    double time_qsort = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < count; i++) {
+        struct site *in = orig + i * n, *out = packed + i * n;
+        for (size_t j = 0; j < n; j++) {
+            items[j] = (struct sort_item) {
+                .key = (uint64_t)in[j].callee << 32 | (uint64_t)in[j].line << 12 | in[j].column,
+                .value = j,
+            };
+        }
+        sort_items(items, tmp, n);
+        for (size_t j = 0; j < n; j++)
+            out[j] = in[items[j].value];
+    }
+    double time_packed = now() - start;
+
+    for (size_t i = 0; i < count * n; i++)
+        if (cmp_site(&sorted[i], &packed[i])) die("Sort mismatch for %zu sites", n);
+
+    printf("%6zu sites   qsort %7.1f ns/site   packed %7.1f ns/site   %5.1fx\n", n,
+           time_qsort * 1e9 / (count * n), time_packed * 1e9 / (count * n), time_qsort / time_packed);
+
+    free(tmp);
+    free(items);
+    free(packed);
+    free(sorted);
+    free(orig);
+}
+
+int main(void) {
+    static const size_t sizes[] = { 4, 16, 64, 256, 4096, 65536 };
+    for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++)
+        run(sizes[i]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "util.h"
+#include "hashtable.h"
+#include "cache.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "LXCACHE"
+#define CACHE_VERSION 3
+
+/* Cache entry layout:
+ *     magic, version, parse time in microseconds,
+ *     number of dependencies,
+ *     for each dependency: path length, path, content hash
+ *     partial callgraph of the translation unit (see serialize.c)
+ * Entries are named after the key, which is a hash
+ * of the compile command, its working directory and
+ * the options changing what is produced by parsing,
+ * so entries of a different mode are just missed.
+ * Dependencies are the source file itself and every
+ * header it included, so an entry is only used
+ * if none of them has changed since it was stored. */
+
+void init_cache(void) {
+    if (!config.cache_dir) return;
+
+    if (!*config.cache_dir || (mkdir(config.cache_dir, 0777) < 0 && errno != EEXIST)) {
+        warn("Cannot create cache directory '%s', cache is disabled", config.cache_dir);
+        free(config.cache_dir);
+        config.cache_dir = NULL;
+    }
+}
+
+static uint64_t parse_mode_key(void) {
+    uint64_t h = uint_hash64(config.skip_system_headers |
+                             config.keep_external_calls << 1 |
+                             config.call_sites << 2 |
+                             (uint64_t)config.function_identity << 8);
+    if (config.project_root)
+        h ^= hash64(config.project_root, strlen(config.project_root));
+    return h;
+}
+
+uint64_t cache_key(const char *dir, const char *const *args, size_t nargs) {
+    uint64_t h = uint_hash64(parse_mode_key()) ^ hash64(dir, strlen(dir));
+    for (size_t i = 0; i < nargs; i++)
+        h = uint_hash64(h) ^ hash64(args[i], strlen(args[i]));
+    return h;
+}
+
+static void entry_path(char *buf, size_t size, uint64_t key) {
+    snprintf(buf, size, "%s/%016"PRIx64".lxc", config.cache_dir, key);
+}
+
+static void stats_path(char *buf, size_t size, const char *dir) {
+    snprintf(buf, size, "%s/%016"PRIx64".lxs", config.cache_dir, cache_key(dir, NULL, 0));
+}
+
+bool cache_load_stats(const char *dir, struct graph_stats *stats) {
+    if (!config.cache_dir) return 0;
+
+    char path[PATH_MAX + 1];
+    stats_path(path, sizeof path, dir);
+    FILE *in = fopen(path, "rb");
+    if (!in) return 0;
+
+    /* Caller's guesses are kept if the file is short */
+    char magic[sizeof CACHE_MAGIC];
+    uint32_t version;
+    struct graph_stats tmp;
+    bool res = fread(magic, sizeof magic, 1, in) == 1 &&
+            !memcmp(magic, CACHE_MAGIC, sizeof magic) &&
+            fread(&version, sizeof version, 1, in) == 1 &&
+            version == CACHE_VERSION &&
+            fread(&tmp, sizeof tmp, 1, in) == 1;
+    fclose(in);
+    if (res) *stats = tmp;
+    return res;
+}
+
+void cache_store_stats(const char *dir, const struct graph_stats *stats) {
+    if (!config.cache_dir) return;
+
+    char path[PATH_MAX + 1];
+    stats_path(path, sizeof path, dir);
+    FILE *out = fopen(path, "wb");
+    if (!out) goto e_open;
+
+    uint32_t version = CACHE_VERSION;
+    bool res = fwrite(CACHE_MAGIC, sizeof CACHE_MAGIC, 1, out) == 1 &&
+            fwrite(&version, sizeof version, 1, out) == 1 &&
+            fwrite(stats, sizeof *stats, 1, out) == 1;
+    if (!fclose(out) && res) return;
+
+    unlink(path);
+e_open:
+    warn("Cannot write graph statistics '%s'", path);
+}
+
+static bool hash_file(const char *path, uint64_t *hash) {
+    struct mapping map = map_file(path);
+    if (!map.addr) return 0;
+    *hash = hash64(map.addr, map.size);
+    unmap_file(map);
+    return 1;
+}
+
+static FILE *open_entry(uint64_t key, uint64_t *time) {
+    char path[PATH_MAX + 1];
+    entry_path(path, sizeof path, key);
+
+    FILE *in = fopen(path, "rb");
+    if (!in) return NULL;
+
+    char magic[sizeof CACHE_MAGIC];
+    uint32_t version;
+    if (fread(magic, sizeof magic, 1, in) != 1 ||
+        memcmp(magic, CACHE_MAGIC, sizeof magic) ||
+        fread(&version, sizeof version, 1, in) != 1 ||
+        version != CACHE_VERSION ||
+        fread(time, sizeof *time, 1, in) != 1) {
+        fclose(in);
+        return NULL;
+    }
+
+    return in;
+}
+
+bool cache_parse_time(uint64_t key, uint64_t *time) {
+    /* Parse time is recorded even if the entry is stale,
+     * it is still a good estimate for the next parse */
+    FILE *in = open_entry(key, time);
+    if (in) fclose(in);
+    return in != NULL;
+}
+
+bool cache_load(uint64_t key, struct callgraph *dst) {
+    uint64_t time;
+    FILE *in = open_entry(key, &time);
+    if (!in) return 0;
+
+    char *dep = NULL;
+    size_t depcaps = 0;
+    uint32_t ndeps;
+    bool res = 0;
+
+    if (fread(&ndeps, sizeof ndeps, 1, in) != 1) goto e_stale;
+
+    for (uint32_t i = 0; i < ndeps; i++) {
+        uint32_t len;
+        uint64_t hash, cur_hash;
+        if (fread(&len, sizeof len, 1, in) != 1 ||
+            !adjust_buffer((void **)&dep, &depcaps, len + 1, 1) ||
+            fread(dep, 1, len, in) != len ||
+            fread(&hash, sizeof hash, 1, in) != 1) goto e_stale;
+        dep[len] = '\0';
+
+        if (!hash_file(dep, &cur_hash) || cur_hash != hash) {
+            syncdebug("Cache entry %016"PRIx64" is stale: '%s' changed", key, dep);
+            goto e_stale;
+        }
+    }
+
+    res = load_callgraph(dst, in);
+    if (!res) warn("Corrupted cache entry %016"PRIx64, key);
+
+e_stale:
+    free(dep);
+    fclose(in);
+    return res;
+}
+
+void cache_store(uint64_t key, uint64_t time, const char *dir, char *const *deps, size_t ndeps, struct callgraph *cg) {
+    char path[PATH_MAX + 1], tmp[PATH_MAX + 1], dep[PATH_MAX + 1];
+    entry_path(path, sizeof path, key);
+    snprintf(tmp, sizeof tmp, "%s/.tmp-XXXXXX", config.cache_dir);
+
+    /* Write to the temporary file first and rename it
+     * afterwards so that readers never see partial entries */
+    int fd = mkstemp(tmp);
+    if (fd < 0) goto e_open;
+    FILE *out = fdopen(fd, "wb");
+    if (!out) {
+        close(fd);
+        goto e_open;
+    }
+
+    uint32_t version = CACHE_VERSION, count = ndeps;
+    if (fwrite(CACHE_MAGIC, sizeof CACHE_MAGIC, 1, out) != 1 ||
+        fwrite(&version, sizeof version, 1, out) != 1 ||
+        fwrite(&time, sizeof time, 1, out) != 1 ||
+        fwrite(&count, sizeof count, 1, out) != 1) goto e_write;
+
+    for (size_t i = 0; i < ndeps; i++) {
+        if (deps[i][0] != '/') snprintf(dep, sizeof dep, "%s/%s", dir, deps[i]);
+        else snprintf(dep, sizeof dep, "%s", deps[i]);
+
+        uint64_t hash;
+        uint32_t len = strlen(dep);
+        if (!hash_file(dep, &hash)) goto e_write;
+        if (fwrite(&len, sizeof len, 1, out) != 1 ||
+            fwrite(dep, 1, len, out) != len ||
+            fwrite(&hash, sizeof hash, 1, out) != 1) goto e_write;
+    }
+
+    if (!save_callgraph(cg, out)) goto e_write;
+    if (fclose(out)) goto e_close;
+    if (rename(tmp, path) < 0) goto e_close;
+    return;
+
+e_write:
+    fclose(out);
+e_close:
+    unlink(tmp);
+e_open:
+    warn("Cannot write cache entry '%s'", path);
+}
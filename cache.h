@@ -0,0 +1,26 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#ifndef CACHE_H_
+#define CACHE_H_ 1
+
+#include "callgraph.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sizes of the graph built by the previous run */
+struct graph_stats {
+    uint64_t functions;
+    uint64_t files;
+    uint64_t calls;
+};
+
+uint64_t cache_key(const char *dir, const char *const *args, size_t nargs);
+bool cache_load(uint64_t key, struct callgraph *dst);
+bool cache_parse_time(uint64_t key, uint64_t *time);
+void cache_store(uint64_t key, uint64_t time, const char *dir, char *const *deps, size_t ndeps, struct callgraph *cg);
+bool cache_load_stats(const char *dir, struct graph_stats *stats);
+void cache_store_stats(const char *dir, const struct graph_stats *stats);
+void init_cache(void);
+
+#endif
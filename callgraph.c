@@ -1,135 +1,616 @@
 /* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
 
+#define _XOPEN_SOURCE 700
+
 #include "util.h"
 #include "hashtable.h"
+#include "swisstable.h"
 #include "callgraph.h"
+#include "cache.h"
 #include "worker.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
-#include <limits.h>
 #include <clang-c/Index.h>
 #include <clang-c/CXCompilationDatabase.h>
 
-#define BATCH_SIZE 16
+#define CHILD_READ_SIZE 65536
+#define CHILD_POLL_INTERVAL 100
+#define EXIT_CANNOT_PARSE 2
+#define VISITED_STRIPES 64
+#define PREAMBLE_MIN_FILES 4
+/* Guesses for sizing tables before the first run */
+#define FUNCTIONS_PER_COMMAND 16
+#define FILES_PER_COMMAND 2
+#define CALLS_PER_COMMAND 32
+#define SHARED_STRIPES 256
 
 struct parse_context {
     struct callgraph *callgraph;
+    /* Arena for the new nodes, it belongs either
+     * to the graph or to the thread in shared mode */
+    struct arena *arena;
     struct function *current;
+    struct swisstable refs;
+    /* Call sites already seen in this file, only
+     * needed when sites are not a part of the edge */
+    struct swisstable sites;
+    struct arena site_arena;
+    /* Declarations usually come in runs from
+     * the same file, so remember the last one */
+    CXFile last_file;
+    bool last_external;
 };
 
-static struct file *add_file(struct callgraph *cg, const char *file) {
-    if (!strncmp(file, "./", 2)) file += 2;
+/* Function referenced from the current file,
+ * cursors are only valid within their file */
+struct reference {
+    ht_head_t head;
+    CXCursor decl;
+    struct function *function;
+};
 
-    size_t len = strlen(file);
-    struct file dummy = { .head.hash = hash64(file, len), .name = file };
-    ht_head_t **h = ht_lookup_ptr(&cg->files, &dummy.head);
-    if (*h) return container_of(*h, struct file, head);
+/* Call site, where the same call can appear several
+ * times, for example from a macro expanded into it */
+struct call_site {
+    ht_head_t head;
+    struct function *caller;
+    struct function *callee;
+    int line;
+    int column;
+};
+
+/* Function definition from a header, which body
+ * was already visited while parsing some file.
+ * File and function names are interned */
+struct visited {
+    ht_head_t head;
+    int line;
+    int column;
+    const char *file;
+    const char *name;
+};
+
+/* Set of visited definitions shared by all parsing threads,
+ * it is split into stripes with separate locks to reduce contention */
+static struct visited_stripe {
+    pthread_mutex_t mtx;
+    struct hashtable ht;
+} __attribute__((aligned(CACHE_LINE))) visited_set[VISITED_STRIPES];
+
+static bool eq_visited(const ht_head_t *a, const ht_head_t *b) {
+    const struct visited *av = container_of(a, const struct visited, head);
+    const struct visited *bv = container_of(b, const struct visited, head);
+    return av->line == bv->line && av->column == bv->column &&
+            av->name == bv->name && av->file == bv->file;
+}
 
-    struct file *new = calloc(1, sizeof *new + len + 1);
-    memcpy(new + 1, file, len + 1);
-    new->name = (char *)(new + 1);
-    new->head = dummy.head;
+static void init_visited(void) {
+    for (size_t i = 0; i < VISITED_STRIPES; i++) {
+        pthread_mutex_init(&visited_set[i].mtx, NULL);
+        ht_init(&visited_set[i].ht, HT_INIT_CAPS, eq_visited);
+    }
+}
+
+static void fini_visited(void) {
+    for (size_t i = 0; i < VISITED_STRIPES; i++) {
+        ht_iter_t it = ht_begin(&visited_set[i].ht);
+        for (ht_head_t *cur; (cur = ht_erase_current(&it)); )
+            free(container_of(cur, struct visited, head));
+        ht_free(&visited_set[i].ht);
+        pthread_mutex_destroy(&visited_set[i].mtx);
+    }
+}
+
+/* Returns true if the definition was not visited before */
+static bool mark_visited(const char *file, const char *name, int line, int col) {
+    struct visited dummy = {
+        .head.hash = interned_hash(name) ^ uint_hash64(interned_hash(file) + ((uint64_t)line << 16) + col),
+        .line = line,
+        .column = col,
+        .file = file,
+        .name = name,
+    };
+
+    struct visited_stripe *stripe = &visited_set[dummy.head.hash % VISITED_STRIPES];
+    pthread_mutex_lock(&stripe->mtx);
+    ht_head_t **h = ht_lookup_ptr(&stripe->ht, &dummy.head);
+    bool res = !*h;
+    if (res) {
+        struct visited *new = malloc(sizeof *new);
+        *new = dummy;
+        ht_insert_hint(&stripe->ht, h, &new->head);
+    }
+    pthread_mutex_unlock(&stripe->mtx);
+    return res;
+}
+
+/* Single graph filled by all parsing threads at once.
+ * Hashtable buckets are protected by striped locks, while
+ * resizing the table requires exclusive access to it.
+ * Lists of calls and fields of functions are protected
+ * by node locks, chosen by the address of the node.
+ * Lists of functions of files are changed rarely,
+ * so there is a single lock for all of them.
+ * Lock order is resize, bucket, node, file lists */
+struct shared_table {
+    pthread_rwlock_t resize;
+    pthread_mutex_t buckets[SHARED_STRIPES];
+};
+
+struct shared_graph {
+    struct shared_table files;
+    struct shared_table functions;
+    struct shared_table calls;
+    pthread_mutex_t nodes[SHARED_STRIPES];
+    pthread_mutex_t file_lists;
+};
+
+static void init_shared_table(struct shared_table *st) {
+    pthread_rwlock_init(&st->resize, NULL);
+    for (size_t i = 0; i < SHARED_STRIPES; i++)
+        pthread_mutex_init(&st->buckets[i], NULL);
+}
+
+static void fini_shared_table(struct shared_table *st) {
+    pthread_rwlock_destroy(&st->resize);
+    for (size_t i = 0; i < SHARED_STRIPES; i++)
+        pthread_mutex_destroy(&st->buckets[i]);
+}
+
+static void make_shared(struct callgraph *cg) {
+    struct shared_graph *shared = malloc(sizeof *shared);
+    init_shared_table(&shared->files);
+    init_shared_table(&shared->functions);
+    init_shared_table(&shared->calls);
+    for (size_t i = 0; i < SHARED_STRIPES; i++)
+        pthread_mutex_init(&shared->nodes[i], NULL);
+    pthread_mutex_init(&shared->file_lists, NULL);
+    cg->shared = shared;
+}
+
+static void unmake_shared(struct callgraph *cg) {
+    struct shared_graph *shared = cg->shared;
+    fini_shared_table(&shared->files);
+    fini_shared_table(&shared->functions);
+    fini_shared_table(&shared->calls);
+    for (size_t i = 0; i < SHARED_STRIPES; i++)
+        pthread_mutex_destroy(&shared->nodes[i]);
+    pthread_mutex_destroy(&shared->file_lists);
+    free(shared);
+    cg->shared = NULL;
+}
+
+static ht_head_t **lock_bucket(struct shared_table *st, struct hashtable *ht, ht_head_t *key) {
+    pthread_rwlock_rdlock(&st->resize);
+    /* Capacity cannot change while resize lock is held */
+    pthread_mutex_lock(&st->buckets[key->hash % ht->caps % SHARED_STRIPES]);
+    return ht_lookup_ptr(ht, key);
+}
+
+static void unlock_bucket(struct shared_table *st, struct hashtable *ht, ht_head_t *key, bool inserted) {
+    bool grow = 0;
+    if (inserted) {
+        intptr_t size = __atomic_add_fetch(&ht->size, 1, __ATOMIC_RELAXED);
+        grow = HT_LOAD_FACTOR(size) > ht->caps;
+    }
+    pthread_mutex_unlock(&st->buckets[key->hash % ht->caps % SHARED_STRIPES]);
+    pthread_rwlock_unlock(&st->resize);
+
+    if (grow) {
+        /* Other threads are waiting anyway, so the table
+         * is resized at once instead of incrementally */
+        pthread_rwlock_wrlock(&st->resize);
+        if (HT_LOAD_FACTOR(ht->size) > ht->caps)
+            ht_resize(ht, HT_CAPS_STEP(ht->caps));
+        pthread_rwlock_unlock(&st->resize);
+    }
+}
+
+static pthread_mutex_t *node_lock(struct callgraph *cg, const void *node) {
+    return &cg->shared->nodes[uint_hash64((uintptr_t)node) % SHARED_STRIPES];
+}
+
+static struct file *new_file(struct arena *arena, const struct file *key) {
+    struct file *new = arena_alloc(arena, sizeof *new);
+    new->name = key->name;
+    new->head.hash = key->head.hash;
     list_init(&new->functions);
     list_init(&new->calls);
     list_init(&new->called);
+    return new;
+}
+
+static struct file *get_file(struct callgraph *cg, struct arena *arena, const char *file) {
+    if (!strncmp(file, "./", 2)) file += 2;
+
+    const char *name = intern_string(file);
+    struct file dummy = { .head.hash = interned_hash(name), .name = name };
+
+    if (cg->shared) {
+        struct shared_table *st = &cg->shared->files;
+        ht_head_t **h = lock_bucket(st, &cg->files, &dummy.head);
+        bool inserted = !*h;
+        if (inserted) *h = &new_file(arena, &dummy)->head;
+        struct file *res = container_of(*h, struct file, head);
+        unlock_bucket(st, &cg->files, &dummy.head, inserted);
+        return res;
+    }
 
+    ht_head_t **h = ht_lookup_ptr(&cg->files, &dummy.head);
+    if (*h) return container_of(*h, struct file, head);
+
+    struct file *new = new_file(arena, &dummy);
     ht_insert_hint(&cg->files, h, &new->head);
     return new;
 }
 
-static struct function *add_function_ref(struct callgraph *cg, const char *function) {
-    size_t len = strlen(function);
-    struct function dummy = { .head.hash = hash64(function, len), .name = function };
-    ht_head_t **h = ht_lookup_ptr(&cg->functions, &dummy.head);
-    if (*h) return container_of(*h, struct function, head);
+struct file *add_file(struct callgraph *cg, const char *file) {
+    return get_file(cg, &cg->arena, file);
+}
 
-    struct function *new = calloc(1, sizeof *new + len + 1);
-    memcpy(new + 1, function, len + 1);
-    new->name = (char *)(new + 1);
-    new->head = dummy.head;
+static struct function *new_function(struct arena *arena, const struct function *key) {
+    struct function *new = arena_alloc(arena, sizeof *new);
+    new->name = key->name;
+    new->head.hash = key->head.hash;
+    new->usr = key->usr;
     list_init(&new->calls);
     list_init(&new->called);
     list_init(&new->in_file);
+    return new;
+}
 
+static struct function *insert_function(struct callgraph *cg, struct arena *arena, ht_head_t **h, const struct function *key) {
+    struct function *new = new_function(arena, key);
     ht_insert_hint(&cg->functions, h, &new->head);
     return new;
 }
 
-static struct function *add_function(struct callgraph *cg, struct file *file, const char *function,
-                                     int line, int col, bool is_extern, bool is_inline) {
-    size_t len = strlen(function);
-    struct function dummy = { .head.hash = hash64(function, len), .name = function };
-    ht_head_t **h = ht_lookup_ptr(&cg->functions, &dummy.head);
-    if (*h) {
-        struct function *fn = container_of(*h, struct function, head);
-        if (!fn->is_definition) {
-            if (fn->file) list_erase(&fn->in_file);
-            list_append(&file->functions, &fn->in_file);
-            fn->file = file;
-            fn->line = line;
-            fn->column = col;
-            fn->is_extern = is_extern;
-            fn->is_inline = is_inline;
+struct function *add_function_ref(struct callgraph *cg, const struct function *key) {
+    ht_head_t **h = ht_lookup_ptr(&cg->functions, (ht_head_t *)&key->head);
+    if (*h) return container_of(*h, struct function, head);
+    return insert_function(cg, &cg->arena, h, key);
+}
+
+static void define_function(struct callgraph *cg, struct function *fn, struct file *file, int line, int col, bool is_extern, bool is_inline) {
+    pthread_mutex_t *mtx = cg->shared ? node_lock(cg, fn) : NULL;
+    if (mtx) pthread_mutex_lock(mtx);
+
+    /* Most of declarations are repeated in many files */
+    if (!fn->is_definition && (fn->file != file || fn->line != line || fn->column != col)) {
+        if (mtx) pthread_mutex_lock(&cg->shared->file_lists);
+        if (fn->file) list_erase(&fn->in_file);
+        list_append(&file->functions, &fn->in_file);
+        if (mtx) pthread_mutex_unlock(&cg->shared->file_lists);
+        fn->file = file;
+        fn->line = line;
+        fn->column = col;
+    }
+    if (!fn->is_definition) {
+        fn->is_extern = is_extern;
+        fn->is_inline = is_inline;
+    }
+
+    if (mtx) pthread_mutex_unlock(mtx);
+}
+
+static void set_definition(struct callgraph *cg, struct function *fn) {
+    pthread_mutex_t *mtx = cg->shared ? node_lock(cg, fn) : NULL;
+    if (mtx) pthread_mutex_lock(mtx);
+    fn->is_definition = 1;
+    if (mtx) pthread_mutex_unlock(mtx);
+}
+
+static struct function *shared_function(struct callgraph *cg, struct arena *arena, const struct function *key, bool create) {
+    struct shared_table *st = &cg->shared->functions;
+    struct function *new = create ? new_function(arena, key) : NULL;
+
+    ht_head_t **h = lock_bucket(st, &cg->functions, (ht_head_t *)&key->head);
+    bool inserted = !*h && new;
+    if (inserted) *h = &new->head;
+    struct function *res = *h ? container_of(*h, struct function, head) : NULL;
+    unlock_bucket(st, &cg->functions, (ht_head_t *)&key->head, inserted);
+
+    /* Other thread could have inserted it first, then the
+     * new node is left unused until the arena is freed */
+    return res;
+}
+
+/* Find the function declared by the cursor or create it. In USR mode
+ * display name is only requested if the function is not yet known */
+static struct function *cursor_function(struct callgraph *cg, struct arena *arena, CXCursor cur) {
+    struct function key = { 0 };
+    CXString name = { 0 };
+    bool has_name = 0;
+
+    if (config.function_identity == id_usr) {
+        CXString usr = clang_getCursorUSR(cur);
+        const char *str = clang_getCString(usr);
+        size_t len = strlen(str);
+        if (len) {
+            key.head.hash = hash64(str, len);
+            key.usr = hash64_seed(str, len, USR_SEED);
+        }
+        clang_disposeString(usr);
+        if (!len) {
+            /* Some declarations do not have USR, use their names */
+            name = clang_getCursorDisplayName(cur);
+            key.name = intern_string(clang_getCString(name));
+            key.head.hash = interned_hash(key.name);
+            key.usr = hash64_seed(key.name, strlen(key.name), USR_SEED);
+            has_name = 1;
         }
-        return fn;
+    } else {
+        name = clang_getCursorDisplayName(cur);
+        key = function_key(clang_getCString(name));
+        has_name = 1;
     }
 
-    struct function *new = calloc(1, sizeof *new + len + 1);
-    memcpy(new + 1, function, len + 1);
-    new->name = (char *)(new + 1);
-    new->head = dummy.head;
-    list_init(&new->calls);
-    list_init(&new->called);
-    list_append(&file->functions, &new->in_file);
-    new->file = file;
-    new->line = line;
-    new->column = col;
-    new->is_extern = is_extern;
-    new->is_inline = is_inline;
+    struct function *fn;
+    if (cg->shared) {
+        /* Name is requested without holding the lock */
+        fn = shared_function(cg, arena, &key, 0);
+        if (!fn) {
+            if (!has_name) {
+                name = clang_getCursorDisplayName(cur);
+                key.name = intern_string(clang_getCString(name));
+                has_name = 1;
+            }
+            fn = shared_function(cg, arena, &key, 1);
+        }
+    } else {
+        ht_head_t **h = ht_lookup_ptr(&cg->functions, &key.head);
+        if (*h) {
+            fn = container_of(*h, struct function, head);
+        } else {
+            if (!has_name) {
+                name = clang_getCursorDisplayName(cur);
+                key.name = intern_string(clang_getCString(name));
+                has_name = 1;
+            }
+            fn = insert_function(cg, arena, h, &key);
+        }
+    }
 
-    ht_insert_hint(&cg->functions, h, &new->head);
+    if (has_name) clang_disposeString(name);
+    return fn;
+}
+
+/* Hash only depends on the keys of the functions, so
+ * it stays the same when calls are moved between graphs */
+static struct call call_key(struct function *from, struct function *to, int line, int col) {
+    uint64_t site = config.call_sites ? ((uint64_t)line << 16) + col : 0;
+    return (struct call) {
+        .head.hash = from->head.hash ^ uint_hash64(to->head.hash + site),
+        .caller = from,
+        .callee = to,
+        .line = line,
+        .column = col,
+    };
+}
 
+static struct call *init_call(struct call *new, const struct call *key, float weight) {
+    *new = *key;
+    new->weight = weight;
+    list_append(&key->caller->calls, &new->calls);
+    list_append(&key->callee->called, &new->called);
     return new;
 }
 
-void add_function_call(struct function *from, struct function *to, int line, int col) {
-    struct call *new = malloc(sizeof *new);
-    list_append(&from->calls, &new->calls);
-    list_append(&to->called, &new->called);
-    new->caller = from;
-    new->callee = to;
-    new->weight = 1.;
-    new->line = line;
-    new->column = col;
+/* Weight of an edge is the number of distinct call sites. In
+ * call_sites mode every edge is a single site, so it is not
+ * changed, otherwise link_call() filters out repeated sites */
+static void count_call(struct call *call, float weight) {
+    if (!config.call_sites) call->weight += weight;
+}
+
+struct call *add_function_call(struct callgraph *cg, struct function *from, struct function *to, int line, int col, float weight) {
+    struct call key = call_key(from, to, line, col);
+    ht_head_t **h = ht_lookup_ptr(&cg->calls, &key.head);
+    if (*h) {
+        struct call *call = container_of(*h, struct call, head);
+        count_call(call, weight);
+        return call;
+    }
+
+    struct call *new = init_call(alloc_call(cg), &key, weight);
+    ht_insert_hint(&cg->calls, h, &new->head);
+    return new;
+}
+
+/* Returns true if the call site was not seen before in this file.
+ * Bodies are visited once, so sites are not repeated across files */
+static bool mark_site(struct parse_context *context, struct function *from, struct function *to, int line, int col) {
+    struct call_site dummy = {
+        .head.hash = from->head.hash ^ uint_hash64(to->head.hash + ((uint64_t)line << 16) + col),
+        .caller = from,
+        .callee = to,
+        .line = line,
+        .column = col,
+    };
+
+    ht_head_t **h = sw_lookup_ptr(&context->sites, &dummy.head);
+    if (*h) return 0;
+
+    struct call_site *new = arena_alloc(&context->site_arena, sizeof *new);
+    *new = dummy;
+    sw_insert_hint(&context->sites, h, &new->head);
+    return 1;
+}
+
+static void link_call(struct parse_context *context, struct function *from, struct function *to, int line, int col) {
+    struct callgraph *cg = context->callgraph;
+    struct call key = call_key(from, to, line, col);
+
+    if (!config.call_sites && !mark_site(context, from, to, line, col)) return;
+
+    if (cg->shared) {
+        /* Weight is protected by the bucket lock,
+         * lists of the new call by the node locks */
+        struct shared_table *st = &cg->shared->calls;
+        ht_head_t **h = lock_bucket(st, &cg->calls, &key.head);
+        bool inserted = !*h;
+        if (inserted) {
+            struct call *new = arena_alloc(context->arena, sizeof *new);
+            pthread_mutex_t *mtx_from = node_lock(cg, from), *mtx_to = node_lock(cg, to);
+            if (mtx_from > mtx_to) SWAP(mtx_from, mtx_to);
+            pthread_mutex_lock(mtx_from);
+            if (mtx_to != mtx_from) pthread_mutex_lock(mtx_to);
+            init_call(new, &key, 1.);
+            if (mtx_to != mtx_from) pthread_mutex_unlock(mtx_to);
+            pthread_mutex_unlock(mtx_from);
+            *h = &new->head;
+        } else {
+            count_call(container_of(*h, struct call, head), 1.);
+        }
+        unlock_bucket(st, &cg->calls, &key.head, inserted);
+        return;
+    }
+
+    ht_head_t **h = ht_lookup_ptr(&cg->calls, &key.head);
+    if (*h) {
+        count_call(container_of(*h, struct call, head), 1.);
+        return;
+    }
+
+    struct call *new = init_call(arena_alloc(context->arena, sizeof *new), &key, 1.);
+    ht_insert_hint(&cg->calls, h, &new->head);
+}
+
+static bool eq_reference(const ht_head_t *a, const ht_head_t *b) {
+    const struct reference *ar = container_of(a, const struct reference, head);
+    const struct reference *br = container_of(b, const struct reference, head);
+    return clang_equalCursors(ar->decl, br->decl);
+}
+
+static bool eq_site(const ht_head_t *a, const ht_head_t *b) {
+    const struct call_site *as = container_of(a, const struct call_site, head);
+    const struct call_site *bs = container_of(b, const struct call_site, head);
+    return as->caller == bs->caller && as->callee == bs->callee &&
+            as->line == bs->line && as->column == bs->column;
+}
+
+static void init_context(struct parse_context *context, struct callgraph *cg, struct arena *arena) {
+    *context = (struct parse_context) { .callgraph = cg, .arena = arena };
+    if (!sw_init(&context->refs, SW_INIT_CAPS, eq_reference) ||
+        !sw_init(&context->sites, SW_INIT_CAPS, eq_site))
+        die("Cannot allocate references table");
+}
+
+static void fini_context(struct parse_context *context) {
+    sw_iter_t it = sw_begin(&context->refs);
+    for (ht_head_t *cur; (cur = sw_erase_current(&it)); )
+        free(container_of(cur, struct reference, head));
+    sw_free(&context->refs);
+
+    /* Sites are owned by the arena */
+    context->sites.size = 0;
+    sw_free(&context->sites);
+    arena_free(&context->site_arena);
+}
+
+static bool is_pruning_enabled(void) {
+    return config.skip_system_headers || config.project_root;
+}
+
+static bool is_external(struct parse_context *context, CXCursor cur) {
+    CXSourceLocation loc = clang_getCursorLocation(cur);
+    if (config.skip_system_headers && clang_Location_isInSystemHeader(loc))
+        return 1;
+    if (!config.project_root)
+        return 0;
+
+    CXFile cfile;
+    clang_getExpansionLocation(loc, &cfile, NULL, NULL, NULL);
+    if (!cfile) return 1;
+    if (cfile == context->last_file) return context->last_external;
+
+    CXString path = clang_File_tryGetRealPathName(cfile);
+    const char *str = clang_getCString(path);
+    size_t len = strlen(config.project_root);
+    /* Relative paths are relative to the build directory,
+     * consider them to be inside of the project */
+    bool res = str[0] == '/' && (strncmp(str, config.project_root, len) ||
+            (str[len] != '/' && str[len] != '\0'));
+    clang_disposeString(path);
+
+    context->last_file = cfile;
+    context->last_external = res;
+    return res;
+}
+
+static struct function *find_reference(struct parse_context *context, CXCursor decl) {
+    /* Same function is usually called from many places,
+     * so avoid getting its name and hashing it every time */
+    struct reference dummy = { .head.hash = clang_hashCursor(decl), .decl = decl };
+    ht_head_t **h = sw_lookup_ptr(&context->refs, &dummy.head);
+    if (*h) return container_of(*h, struct reference, head)->function;
+
+    struct reference *new = malloc(sizeof *new);
+    *new = dummy;
+    if (!config.keep_external_calls && is_pruning_enabled() && is_external(context, decl))
+        new->function = NULL;
+    else
+        new->function = cursor_function(context->callgraph, context->arena, decl);
+
+    sw_insert_hint(&context->refs, h, &new->head);
+    return new->function;
 }
 
 static enum CXChildVisitResult visit(CXCursor cur, CXCursor parent, CXClientData data) {
     struct parse_context *context = (struct parse_context *)data;
     (void)parent;
 
+    /* Skip whole subtrees of declarations that are not interesting,
+     * that is cheaper than walking them and excluding them later */
+    if (!context->current && is_pruning_enabled() && is_external(context, cur))
+        return CXChildVisit_Continue;
+
     unsigned line, col;
     switch (clang_getCursorKind(cur)) {
     case CXCursor_CompoundStmt:
         if (context->current)
-            context->current->is_definition = 1;
+            set_definition(context->callgraph, context->current);
         break;
     case CXCursor_FunctionDecl:
     case CXCursor_CXXMethod:
     case CXCursor_FunctionTemplate:;
         bool is_extern =  clang_Cursor_getStorageClass(cur) != CX_SC_Extern;
         bool is_inline = clang_Cursor_isFunctionInlined(cur);
-        CXString name = clang_getCursorDisplayName(cur);
         CXFile cfile;
         clang_getExpansionLocation(clang_getCursorLocation(cur), &cfile, &line, &col, NULL);
         CXString filename = clang_getFileName(cfile);
-        struct file *file = add_file(context->callgraph, clang_getCString(filename));
-        struct function *newfn = add_function(context->callgraph, file,
-                clang_getCString(name), line, col, is_extern, is_inline);
-        clang_disposeString(name);
+        struct file *file = get_file(context->callgraph, context->arena, clang_getCString(filename));
+        struct function *newfn = cursor_function(context->callgraph, context->arena, cur);
+        define_function(context->callgraph, newfn, file, line, col, is_extern, is_inline);
+
+        /* Bodies of functions defined in headers are the same in every
+         * file including them, so only the first thread reaching such
+         * a body walks it, the rest of the edges would be duplicates.
+         * Cache entries need complete information about every file,
+         * so this is disabled when cache is used. */
+        bool skip = !context->current && !config.cache_dir && clang_isCursorDefinition(cur) &&
+                !clang_Location_isFromMainFile(clang_getCursorLocation(cur)) &&
+                !mark_visited(file->name, newfn->name, line, col);
         clang_disposeString(filename);
+        if (skip) {
+            set_definition(context->callgraph, newfn);
+            return CXChildVisit_Continue;
+        }
         if (!context->current) {
             context->current = newfn;
             clang_visitChildren(cur, visit, data);
@@ -144,16 +625,15 @@ static enum CXChildVisitResult visit(CXCursor cur, CXCursor parent, CXClientData
         if (kind == CXCursor_FunctionDecl ||
                 kind == CXCursor_CXXMethod ||
                 kind == CXCursor_FunctionTemplate) {
-            CXString fname = clang_getCursorDisplayName(decl);
             clang_getExpansionLocation(clang_getCursorLocation(cur), NULL, &line, &col, NULL);
-            struct function *fn = add_function_ref(context->callgraph, clang_getCString(fname));
-            clang_disposeString(fname);
+            struct function *fn = find_reference(context, decl);
+            if (!fn) break;
             if (!context->current) {
                 // TODO Static initiallization...
                 break;
             }
             assert(context->current);
-            add_function_call(context->current, fn, line, col);
+            link_call(context, context->current, fn, line, col);
         }
         /* fallthrough */
     default:
@@ -163,79 +643,835 @@ static enum CXChildVisitResult visit(CXCursor cur, CXCursor parent, CXClientData
 }
 
 void free_callgraph(struct callgraph *cg) {
-    ht_iter_t itfile = ht_begin(&cg->files);
-    for (ht_head_t *cur; (cur = ht_erase_current(&itfile));)
-        erase_file(cg, container_of(cur, struct file, head));
+    /* All nodes are in the arena */
+    cg->files.size = 0;
+    cg->functions.size = 0;
+    cg->calls.size = 0;
     ht_free(&cg->files);
-
-    ht_iter_t itfun = ht_begin(&cg->functions);
-    for (ht_head_t *cur; (cur = ht_erase_current(&itfun));)
-        erase_function(cg, container_of(cur, struct function, head));
     ht_free(&cg->functions);
+    ht_free(&cg->calls);
+    arena_free(&cg->arena);
     free(cg);
 }
 
+/* Compile command with all the arguments
+ * prepared for clang_parseTranslationUnit() */
+struct command {
+    char *directory;
+    char *filename;
+    char **args;
+    size_t nargs;
+    uint64_t key;
+    double cost;
+};
+
+/* Per-thread parsing state, it is reused for
+ * all the files parsed by the thread, so libclang
+ * index is not recreated for every batch */
+struct parse_thread {
+    struct callgraph *callgraph;
+    CXIndex index;
+    /* Nodes of the shared graph created by this thread */
+    struct arena arena;
+};
+
+/* Every thread takes commands one at a time
+ * in order of decreasing estimated cost */
 struct arg {
-    struct callgraph **pres;
-    CXCompileCommands cmds;
-    size_t offset;
+    struct parse_thread *threads;
+    struct command **order;
+    size_t *next;
+    size_t size;
+};
+
+struct deps {
+    char **data;
     size_t size;
+    size_t caps;
 };
 
+static void add_dependency(CXFile file, CXSourceLocation *stack, unsigned len, CXClientData data) {
+    struct deps *deps = (struct deps *)data;
+    (void)stack, (void)len;
+
+    CXString name = clang_getFileName(file);
+    bool res = adjust_buffer((void **)&deps->data, &deps->caps, deps->size + 1, sizeof *deps->data);
+    assert(res);
+    deps->data[deps->size++] = strdup(clang_getCString(name));
+    clang_disposeString(name);
+}
+
+static void merge_move_callgraph(struct callgraph *dst, struct callgraph *src);
+
+/* Parse single file into cg, with writing
+ * it to the cache if it is enabled */
+static bool parse_command(struct parse_thread *thread, struct command *cmd, struct callgraph *cg) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!thread->index)
+        thread->index = clang_createIndex(1, config.log_level > 1);
+
+    const char *const *args = (const char *const *)cmd->args;
+    CXTranslationUnit unit = clang_parseTranslationUnit(thread->index, NULL, args, cmd->nargs, NULL, 0, CXTranslationUnit_None);
+    if (!unit) {
+        warn("Cannot parse file '%s'", cmd->filename);
+        return 0;
+    }
+
+    CXCursor cur = clang_getTranslationUnitCursor(unit);
+    if (config.cache_dir) {
+        /* Cache entry should contain only the information
+         * from this file, so parse it separately. Nodes are
+         * still allocated from cg, since they are moved there */
+        struct parse_context tucontext;
+        init_context(&tucontext, create_callgraph(), &cg->arena);
+        clang_visitChildren(cur, visit, (CXClientData)&tucontext);
+        fini_context(&tucontext);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t elapsed = (end.tv_sec - start.tv_sec)*1000000LL + (end.tv_nsec - start.tv_nsec)/1000;
+
+        struct deps deps = { 0 };
+        clang_getInclusions(unit, add_dependency, (CXClientData)&deps);
+        cache_store(cmd->key, elapsed, cmd->directory, deps.data, deps.size, tucontext.callgraph);
+        for (size_t j = 0; j < deps.size; j++)
+            free(deps.data[j]);
+        free(deps.data);
+
+        merge_move_callgraph(cg, tucontext.callgraph);
+        free_callgraph(tucontext.callgraph);
+    } else {
+        struct parse_context context;
+        init_context(&context, cg, cg->shared ? &thread->arena : &cg->arena);
+        clang_visitChildren(cur, visit, (CXClientData)&context);
+        fini_context(&context);
+    }
+
+    clang_disposeTranslationUnit(unit);
+    return 1;
+}
+
+/* Cache entry is loaded into a separate graph first,
+ * so that a truncated or corrupted one does not leave
+ * partial nodes in dst, which is then parsed again */
+static bool load_cached(uint64_t key, struct callgraph *dst) {
+    struct callgraph *tmp = create_callgraph();
+    bool res = cache_load(key, tmp);
+    if (res) merge_move_callgraph(dst, tmp);
+    free_callgraph(tmp);
+    return res;
+}
+
 static void do_parse(int thread_index, void *varg) {
     struct arg *arg = varg;
-    struct parse_context context = { arg->pres[thread_index], NULL };
+    struct parse_thread *thread = &arg->threads[thread_index];
+
+    for (size_t i; (i = __atomic_fetch_add(arg->next, 1, __ATOMIC_RELAXED)) < arg->size; ) {
+        struct command *cmd = arg->order[i];
+        syncdebug("Parsing file %zd '%s'", i, cmd->filename);
+
+        /* Unchanged files are loaded from cache instead */
+        if (config.cache_dir && load_cached(cmd->key, thread->callgraph)) {
+            syncdebug("Loaded file %zd from cache", i);
+            continue;
+        }
+
+        parse_command(thread, cmd, thread->callgraph);
+    }
+}
+
+/* Child process parsing one file. Partial callgraph
+ * is sent back to the parent in the format of save_callgraph() */
+struct child {
+    pid_t pid;
+    int fd;
+    size_t pos;
+    struct timespec start;
+    char *data;
+    size_t size;
+    size_t caps;
+    /* Timed out, waiting for the pipe to be closed */
+    bool killed;
+};
+
+static _Noreturn void run_child(struct command *cmd, int fd) {
+    if (config.memory_limit) {
+        rlim_t limit = (rlim_t)config.memory_limit << 20;
+        setrlimit(RLIMIT_AS, &(struct rlimit) { limit, limit });
+    }
+
+    struct parse_thread thread = { .callgraph = create_callgraph() };
+    if (!parse_command(&thread, cmd, thread.callgraph))
+        _exit(EXIT_CANNOT_PARSE);
+
+    FILE *out = fdopen(fd, "wb");
+    if (!out || !save_callgraph(thread.callgraph, out) || fclose(out))
+        _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+}
+
+static bool spawn_child(struct child *child, struct command *cmd, size_t pos) {
+    int fds[2];
+    if (pipe(fds) < 0) return 0;
+
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    } else if (!pid) {
+        close(fds[0]);
+        run_child(cmd, fds[1]);
+    }
+
+    close(fds[1]);
+    *child = (struct child) { .pid = pid, .fd = fds[0], .pos = pos,
+                              .data = child->data, .caps = child->caps };
+    clock_gettime(CLOCK_MONOTONIC, &child->start);
+    return 1;
+}
+
+/* Returns 1 if child is done, and it exit status in *status */
+static bool read_child(struct child *child, int *status) {
+    bool res = adjust_buffer((void **)&child->data, &child->caps, child->size + CHILD_READ_SIZE, 1);
+    assert(res);
+
+    ssize_t inc = read(child->fd, child->data + child->size, CHILD_READ_SIZE);
+    if (inc > 0) {
+        child->size += inc;
+        return 0;
+    } else if (inc < 0 && errno == EINTR) {
+        return 0;
+    }
+
+    close(child->fd);
+    while (waitpid(child->pid, status, 0) < 0 && errno == EINTR);
+    child->pid = 0;
+    return 1;
+}
+
+/* Output is loaded into a separate graph first, like
+ * cache entries, since the file is parsed again on failure */
+static bool load_child(struct child *child, struct callgraph *dst) {
+    FILE *in = fmemopen(child->data, child->size, "rb");
+    if (!in) return 0;
+
+    struct callgraph *tmp = create_callgraph();
+    bool res = load_callgraph(tmp, in);
+    if (res) merge_move_callgraph(dst, tmp);
+    free_callgraph(tmp);
+    fclose(in);
+    return res;
+}
+
+static void parse_in_processes(struct command **order, size_t ncmds, struct callgraph *dst) {
+    size_t nchildren = config.nprocesses, nactive = 0, next = 0;
+    struct child *children = calloc(nchildren, sizeof *children);
+    struct pollfd *pfds = calloc(nchildren, sizeof *pfds);
+    uint8_t *attempts = calloc(ncmds, sizeof *attempts);
+    size_t *retry = calloc(ncmds, sizeof *retry), nretry = 0;
+
+    while (nactive || next < ncmds || nretry) {
+        /* Fill all free slots, cached files
+         * are loaded without taking a slot */
+        for (size_t i = 0; i < nchildren && (next < ncmds || nretry); i++) {
+            if (children[i].pid) continue;
+
+            while (next < ncmds || nretry) {
+                size_t pos = nretry ? retry[--nretry] : next++;
+                if (!attempts[pos] && config.cache_dir && load_cached(order[pos]->key, dst)) {
+                    debug("Loaded file %zd from cache", pos);
+                    continue;
+                }
+
+                debug("Parsing file %zd '%s'", pos, order[pos]->filename);
+                if (!spawn_child(&children[i], order[pos], pos))
+                    die("Cannot create child process");
+                nactive++;
+                break;
+            }
+        }
+
+        size_t npfds = 0;
+        for (size_t i = 0; i < nchildren; i++)
+            if (children[i].pid) pfds[npfds++] = (struct pollfd) { .fd = children[i].fd, .events = POLLIN };
+        /* Everything left was in the cache */
+        if (!npfds) continue;
+        if (poll(pfds, npfds, config.timeout ? CHILD_POLL_INTERVAL : -1) < 0 && errno != EINTR)
+            die("Cannot wait for child processes");
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (size_t i = 0, j = 0; i < nchildren; i++) {
+            struct child *child = &children[i];
+            if (!child->pid) continue;
+            struct pollfd *pfd = &pfds[j++];
+
+            int64_t elapsed = (now.tv_sec - child->start.tv_sec)*1000LL + (now.tv_nsec - child->start.tv_nsec)/1000000;
+            if (config.timeout && !child->killed && elapsed >= config.timeout*1000LL) {
+                /* Reported once the child is reaped */
+                kill(child->pid, SIGKILL);
+                child->killed = 1;
+            } else if (!pfd->revents) continue;
+
+            int status;
+            if (!read_child(child, &status)) continue;
+            nactive--;
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+                if (load_child(child, dst)) continue;
+            } else if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_CANNOT_PARSE) {
+                /* Clang reported an error, retrying would not help */
+                continue;
+            } else if (child->killed) {
+                /* It would most likely time out again */
+                warn("Parsing file '%s' timed out, skipping", order[child->pos]->filename);
+                continue;
+            }
+
+            if (attempts[child->pos]++ < config.retries) {
+                warn("Child process parsing '%s' failed, retrying", order[child->pos]->filename);
+                retry[nretry++] = child->pos;
+            } else {
+                warn("Child process parsing '%s' failed, skipping", order[child->pos]->filename);
+            }
+        }
+    }
 
-    CXIndex index = clang_createIndex(1, config.log_level > 1);
+    for (size_t i = 0; i < nchildren; i++)
+        free(children[i].data);
+    free(children);
+    free(pfds);
+    free(attempts);
+    free(retry);
+}
+
+static char *dup_string(CXString str) {
+    char *res = strdup(clang_getCString(str));
+    clang_disposeString(str);
+    return res;
+}
+
+static bool in_shard(const char *dir, const char *file) {
+    if (!config.shard_count) return 1;
 
+    /* Files are assigned to shards by their path relative
+     * to the build directory, so that the partition does
+     * not depend on where the project is checked out */
+    size_t dirlen = strlen(dir);
+    if (!strncmp(file, dir, dirlen) && file[dirlen] == '/')
+        file += dirlen + 1;
+    return hash64(file, strlen(file)) % config.shard_count == (uint64_t)config.shard_index;
+}
+
+/* Returns number of arguments starting from arg to drop,
+ * see default_drop_args in util.c for the pattern syntax */
+static size_t match_arg(const char *arg, const char *pat) {
+    size_t len = strlen(pat);
+    if (len > 1 && pat[len - 1] == '*' && pat[len - 2] == ' ') {
+        if (!strncmp(arg, pat, len - 2) && !arg[len - 2]) return 2;
+    } else if (len && pat[len - 1] == '*') {
+        if (!strncmp(arg, pat, len - 1)) return 1;
+    } else if (!strcmp(arg, pat)) return 1;
+    return 0;
+}
 
-    for (size_t i = arg->offset; i < arg->offset + arg->size; i++) {
-        CXCompileCommand cmd = clang_CompileCommands_getCommand(arg->cmds, i);
-        CXString dir = clang_CompileCommand_getDirectory(cmd);
-        chdir(clang_getCString(dir));
-        clang_disposeString(dir);
-        if (config.log_level > 3) {
-            CXString file = clang_CompileCommand_getFilename(cmd);
-            syncdebug("Parsing file %zd '%s'", i, clang_getCString(file));
+static size_t match_drop_args(const char *arg) {
+    for (size_t i = 0; i < config.drop_args.size; i++) {
+        const char *pat = config.drop_args.data[i];
+        if (pat[0] == '!') {
+            if (match_arg(arg, pat + 1)) return 0;
+        } else {
+            size_t ndrop = match_arg(arg, pat);
+            if (ndrop) return ndrop;
+        }
+    }
+    return 0;
+}
+
+static struct command *load_commands(CXCompileCommands ccmds, size_t *pncmds) {
+    size_t ncmds = 0, nall = *pncmds;
+    struct command *cmds = calloc(nall, sizeof *cmds);
+
+    for (size_t i = 0; i < nall; i++) {
+        CXCompileCommand ccmd = clang_CompileCommands_getCommand(ccmds, i);
+        CXString dir = clang_CompileCommand_getDirectory(ccmd);
+        CXString file = clang_CompileCommand_getFilename(ccmd);
+        if (!in_shard(clang_getCString(dir), clang_getCString(file))) {
+            clang_disposeString(dir);
             clang_disposeString(file);
+            continue;
         }
-        // TODO Additional args for compilation?
-        size_t nargs = clang_CompileCommand_getNumArgs(cmd);
-        CXString args[nargs];
-        const char *cargs[nargs];
+
+        struct command *cmd = &cmds[ncmds++];
+        cmd->directory = dup_string(dir);
+        cmd->filename = dup_string(file);
+
+        /* The working directory is shared by all threads,
+         * so instead of changing it, relative paths of every
+         * command are resolved by clang against its own directory */
+        size_t nargs = clang_CompileCommand_getNumArgs(ccmd);
+        cmd->args = calloc(nargs + config.add_args.size + 2, sizeof *cmd->args);
         for (size_t j = 0; j < nargs; j++) {
-            args[j] = clang_CompileCommand_getArg(cmd, j);
-            cargs[j] = clang_getCString(args[j]);
+            CXString arg = clang_CompileCommand_getArg(ccmd, j);
+            /* First argument is the compiler itself */
+            size_t ndrop = j ? match_drop_args(clang_getCString(arg)) : 0;
+            if (ndrop) {
+                clang_disposeString(arg);
+                j += ndrop - 1;
+                continue;
+            }
+            cmd->args[cmd->nargs++] = dup_string(arg);
         }
-        CXTranslationUnit unit = clang_parseTranslationUnit(index, NULL, cargs, nargs, NULL, 0, CXTranslationUnit_None);
-        for (size_t j = 0; j < nargs; j++)
-            clang_disposeString(args[j]);
-        if (!unit) {
-            CXString file = clang_CompileCommand_getFilename(cmd);
-            warn("Cannot parse file '%s'", clang_getCString(file));
-            clang_disposeString(file);
+        for (size_t j = 0; j < config.add_args.size; j++)
+            cmd->args[cmd->nargs++] = strdup(config.add_args.data[j]);
+        cmd->args[cmd->nargs++] = strdup("-working-directory");
+        cmd->args[cmd->nargs++] = strdup(cmd->directory);
+
+        if (config.cache_dir)
+            cmd->key = cache_key(cmd->directory, (const char *const *)cmd->args, cmd->nargs);
+    }
+
+    if (config.shard_count)
+        info("Shard %d/%d contains %zd of %zd files", config.shard_index, config.shard_count, ncmds, nall);
+
+    *pncmds = ncmds;
+    return cmds;
+}
+
+static int cmp_cost(const void *a, const void *b) {
+    double cost_a = (*(struct command **)a)->cost;
+    double cost_b = (*(struct command **)b)->cost;
+    if (cost_a > cost_b) return -1;
+    if (cost_a < cost_b) return 1;
+    return 0;
+}
+
+static struct command **schedule_commands(struct command *cmds, size_t ncmds) {
+    /* Cost of the file is its parse time during the last run
+     * if it was recorded in cache, otherwise it is estimated
+     * from the source size, scaled to match the recorded times */
+    double total_time = 0, total_size = 0;
+    bool *has_time = calloc(ncmds, sizeof *has_time);
+    for (size_t i = 0; i < ncmds; i++) {
+        struct command *cmd = &cmds[i];
+        char path[PATH_MAX + 1];
+        if (cmd->filename[0] != '/') snprintf(path, sizeof path, "%s/%s", cmd->directory, cmd->filename);
+        else snprintf(path, sizeof path, "%s", cmd->filename);
+
+        struct stat stt;
+        double size = stat(path, &stt) < 0 ? 0 : stt.st_size;
+
+        uint64_t time;
+        if (config.cache_dir && cache_parse_time(cmd->key, &time)) {
+            has_time[i] = 1;
+            total_time += time;
+            total_size += size;
+            cmd->cost = time;
+        } else {
+            cmd->cost = size;
+        }
+    }
+
+    double scale = total_size > 0 ? total_time/total_size : 1;
+    struct command **order = malloc(ncmds * sizeof *order);
+    for (size_t i = 0; i < ncmds; i++) {
+        if (!has_time[i]) cmds[i].cost *= scale;
+        order[i] = &cmds[i];
+    }
+    free(has_time);
+
+    qsort(order, ncmds, sizeof *order, cmp_cost);
+    return order;
+}
+
+static void free_commands(struct command *cmds, size_t ncmds) {
+    for (size_t i = 0; i < ncmds; i++) {
+        for (size_t j = 0; j < cmds[i].nargs; j++)
+            free(cmds[i].args[j]);
+        free(cmds[i].args);
+        free(cmds[i].directory);
+        free(cmds[i].filename);
+    }
+    free(cmds);
+}
+
+/* Files compiled with the same flags from the same directory
+ * often start with the same block of #include directives.
+ * This block is precompiled once and every such file is parsed
+ * with -include-pch. Headers are include guarded, so the original
+ * directives become no-ops. Since libclang index is created with
+ * excludeDeclarationsFromPCH, declarations from the precompiled
+ * header are visited only once, when it is built */
+struct preamble_entry {
+    struct command *cmd;
+    size_t srcpos;
+    uint64_t key;
+    char **includes;
+    size_t nincludes;
+};
+
+struct preamble {
+    struct preamble_entry *members;
+    size_t nmembers;
+    size_t nincludes;
+    char *header;
+    char *pch;
+};
+
+struct preamble_set {
+    struct preamble_entry *entries;
+    size_t nentries;
+    struct preamble *preambles;
+    size_t count;
+    char dir[PATH_MAX + 1];
+};
+
+struct preamble_arg {
+    struct parse_thread *threads;
+    struct preamble *preambles;
+    size_t *next;
+    size_t size;
+};
+
+static const char *find_comment_end(const char *pos, const char *end) {
+    for (; pos + 1 < end; pos++)
+        if (pos[0] == '*' && pos[1] == '/') return pos + 2;
+    return NULL;
+}
+
+static bool has_open_comment(const char *pos, const char *end) {
+    for (; pos + 1 < end; pos++) {
+        if (pos[0] != '/' || pos[1] != '*') continue;
+        if (!(pos = find_comment_end(pos + 2, end))) return 1;
+        pos--;
+    }
+    return 0;
+}
+
+/* Returns leading #include directives of the file
+ * that are only preceded by comments and empty lines */
+static char **scan_includes(const char *path, size_t *pcount) {
+    char **includes = NULL;
+    size_t count = 0, caps = 0;
+    bool comment = 0;
+
+    struct mapping map = map_file(path);
+    const char *pos = map.addr, *end = map.addr + map.size;
+    while (pos && pos < end) {
+        const char *eol = memchr(pos, '\n', end - pos);
+        if (!eol) eol = end;
+
+        while (pos < eol) {
+            if (comment) {
+                const char *cend = find_comment_end(pos, eol);
+                if (!cend) break;
+                pos = cend;
+                comment = 0;
+            } else if (isspace((unsigned char)*pos)) {
+                pos++;
+            } else if (eol - pos > 1 && pos[0] == '/' && pos[1] == '*') {
+                pos += 2;
+                comment = 1;
+            } else break;
+        }
+
+        if (comment || pos == eol || (eol - pos > 1 && pos[0] == '/' && pos[1] == '/')) {
+            pos = eol + 1;
             continue;
         }
 
-        CXCursor cur = clang_getTranslationUnitCursor(unit);
-        clang_visitChildren(cur, visit, (CXClientData)&context);
-        clang_disposeTranslationUnit(unit);
+        /* Anything else than a simple #include ends the block */
+        const char *dir = pos + 1;
+        while (dir < eol && isspace((unsigned char)*dir)) dir++;
+        if (*pos != '#' || eol - dir < 8 || strncmp(dir, "include", 7) ||
+            isalnum((unsigned char)dir[7]) || dir[7] == '_') break;
+        if (memchr(pos, '\\', eol - pos) || has_open_comment(pos, eol)) break;
+
+        const char *lend = eol;
+        while (lend > pos && isspace((unsigned char)lend[-1])) lend--;
+        bool res = adjust_buffer((void **)&includes, &caps, count + 1, sizeof *includes);
+        assert(res);
+        includes[count++] = strndup(pos, lend - pos);
+        pos = eol + 1;
+    }
+
+    if (map.addr) unmap_file(map);
+    *pcount = count;
+    return includes;
+}
+
+static bool source_arg(struct command *cmd, size_t *pos) {
+    for (size_t i = 0; i < cmd->nargs; i++) {
+        if (!strcmp(cmd->args[i], cmd->filename)) {
+            *pos = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Files can share a preamble if they are compiled with
+ * the same flags (apart from the output) and are located in the
+ * same directory, so that quoted includes resolve the same way */
+static uint64_t preamble_key(struct command *cmd, const char *first) {
+    const char *slash = strrchr(cmd->filename, '/');
+    uint64_t h = hash64(cmd->directory, strlen(cmd->directory));
+    h = uint_hash64(h) ^ hash64(cmd->filename, slash ? (size_t)(slash - cmd->filename) : 0);
+    for (size_t i = 0; i < cmd->nargs; i++) {
+        if (!strcmp(cmd->args[i], cmd->filename)) continue;
+        if (!strcmp(cmd->args[i], "-o")) {
+            i++;
+            continue;
+        }
+        h = uint_hash64(h) ^ hash64(cmd->args[i], strlen(cmd->args[i]));
+    }
+    return uint_hash64(h) ^ hash64(first, strlen(first));
+}
+
+static int cmp_preamble_entry(const void *a, const void *b) {
+    uint64_t key_a = ((const struct preamble_entry *)a)->key;
+    uint64_t key_b = ((const struct preamble_entry *)b)->key;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+static void group_preambles(struct preamble_set *set, struct command *cmds, size_t ncmds) {
+    struct preamble_entry *entries = calloc(ncmds + 1, sizeof *entries);
+    size_t nentries = 0;
+    for (size_t i = 0; i < ncmds; i++) {
+        struct command *cmd = &cmds[i];
+        size_t srcpos;
+        if (!source_arg(cmd, &srcpos)) continue;
+
+        char path[PATH_MAX + 1];
+        if (cmd->filename[0] != '/') snprintf(path, sizeof path, "%s/%s", cmd->directory, cmd->filename);
+        else snprintf(path, sizeof path, "%s", cmd->filename);
+
+        struct preamble_entry *entry = &entries[nentries];
+        entry->includes = scan_includes(path, &entry->nincludes);
+        if (!entry->nincludes) {
+            free(entry->includes);
+            continue;
+        }
+        entry->cmd = cmd;
+        entry->srcpos = srcpos;
+        entry->key = preamble_key(cmd, entry->includes[0]);
+        nentries++;
+    }
+
+    qsort(entries, nentries, sizeof *entries, cmp_preamble_entry);
+
+    struct preamble *preambles = NULL;
+    size_t count = 0, caps = 0;
+    for (size_t i = 0, j; i < nentries; i = j) {
+        /* Shared preamble is the longest common
+         * prefix of include blocks of the group */
+        size_t len = entries[i].nincludes;
+        for (j = i + 1; j < nentries && entries[j].key == entries[i].key; j++) {
+            size_t k = 0;
+            while (k < len && k < entries[j].nincludes &&
+                   !strcmp(entries[i].includes[k], entries[j].includes[k])) k++;
+            len = k;
+        }
+        if (j - i < PREAMBLE_MIN_FILES || !len) continue;
+
+        bool res = adjust_buffer((void **)&preambles, &caps, count + 1, sizeof *preambles);
+        assert(res);
+        preambles[count++] = (struct preamble) {
+            .members = &entries[i],
+            .nmembers = j - i,
+            .nincludes = len,
+        };
+    }
+
+    set->entries = entries;
+    set->nentries = nentries;
+    set->preambles = preambles;
+    set->count = count;
+}
+
+static bool write_preamble_header(struct preamble *pre) {
+    FILE *out = fopen(pre->header, "w");
+    if (!out) return 0;
+    for (size_t i = 0; i < pre->nincludes; i++)
+        fprintf(out, "%s\n", pre->members->includes[i]);
+    return !fclose(out);
+}
+
+static void build_preamble(struct parse_thread *thread, struct preamble *pre) {
+    struct command *cmd = pre->members->cmd;
+    if (!write_preamble_header(pre)) {
+        warn("Cannot write preamble header '%s'", pre->header);
+        return;
+    }
+
+    /* Header is compiled with the flags of the first file
+     * in place of its source, quoted includes are resolved
+     * relative to the directory of the source */
+    size_t srcpos = pre->members->srcpos;
+    const char *slash = strrchr(cmd->filename, '/');
+    char *srcdir = slash ? strndup(cmd->filename, slash - cmd->filename + 1) : strdup(".");
+    const char *ext = strrchr(cmd->filename, '.');
+    const char *lang = ext && !strcmp(ext, ".c") ? "c-header" : "c++-header";
+
+    const char **args = calloc(cmd->nargs + 4, sizeof *args);
+    size_t nargs = 0;
+    for (size_t i = 0; i < cmd->nargs; i++) {
+        if (i == srcpos) {
+            args[nargs++] = "-x";
+            args[nargs++] = lang;
+            args[nargs++] = pre->header;
+        } else args[nargs++] = cmd->args[i];
+    }
+    args[nargs++] = "-iquote";
+    args[nargs++] = srcdir;
+
+    if (!thread->index)
+        thread->index = clang_createIndex(1, config.log_level > 1);
+
+    CXTranslationUnit unit = clang_parseTranslationUnit(thread->index, NULL, args, nargs, NULL, 0,
+            CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization);
+    if (!unit) {
+        warn("Cannot parse preamble of '%s'", cmd->filename);
+        goto e_parse;
+    }
+
+    struct parse_context context;
+    struct callgraph *cg = thread->callgraph;
+    init_context(&context, cg, cg->shared ? &thread->arena : &cg->arena);
+    clang_visitChildren(clang_getTranslationUnitCursor(unit), visit, (CXClientData)&context);
+    fini_context(&context);
+
+    if (clang_saveTranslationUnit(unit, pre->pch, clang_defaultSaveOptions(unit)) != CXSaveError_None) {
+        warn("Cannot save preamble '%s'", pre->pch);
+    } else {
+        for (size_t i = 0; i < pre->nmembers; i++) {
+            struct command *member = pre->members[i].cmd;
+            member->args = realloc(member->args, (member->nargs + 2) * sizeof *member->args);
+            member->args[member->nargs++] = strdup("-include-pch");
+            member->args[member->nargs++] = strdup(pre->pch);
+        }
+    }
+
+    clang_disposeTranslationUnit(unit);
+e_parse:
+    free(args);
+    free(srcdir);
+}
+
+static void do_build_preambles(int thread_index, void *varg) {
+    struct preamble_arg *arg = varg;
+    struct parse_thread *thread = &arg->threads[thread_index];
+
+    for (size_t i; (i = __atomic_fetch_add(arg->next, 1, __ATOMIC_RELAXED)) < arg->size; ) {
+        syncdebug("Building preamble %zd of %zd files", i, arg->preambles[i].nmembers);
+        build_preamble(thread, &arg->preambles[i]);
+    }
+}
+
+static void init_preambles(struct preamble_set *set, struct parse_thread *threads, struct command *cmds, size_t ncmds) {
+    *set = (struct preamble_set) { 0 };
+    if (!config.shared_preambles) return;
+    if (config.cache_dir) {
+        warn("Shared preambles cannot be used with cache, ignoring");
+        return;
     }
 
-    clang_disposeIndex(index);
+    const char *tmp = getenv("TMPDIR");
+    snprintf(set->dir, sizeof set->dir, "%s/"PROG_NAME"-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(set->dir)) {
+        warn("Cannot create directory for preambles");
+        set->dir[0] = '\0';
+        return;
+    }
+
+    group_preambles(set, cmds, ncmds);
+    for (size_t i = 0; i < set->count; i++) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof path, "%s/%zd.h", set->dir, i);
+        set->preambles[i].header = strdup(path);
+        snprintf(path, sizeof path, "%s/%zd.pch", set->dir, i);
+        set->preambles[i].pch = strdup(path);
+    }
+    info("Found %zd shared preambles", set->count);
+
+    size_t next = 0;
+    for (ssize_t i = 0; i < nproc; i++) {
+        struct preamble_arg arg = {
+            .threads = threads,
+            .preambles = set->preambles,
+            .next = &next,
+            .size = set->count,
+        };
+        submit_work(do_build_preambles, &arg, sizeof arg);
+    }
+    drain_work();
+}
+
+static void fini_preambles(struct preamble_set *set) {
+    for (size_t i = 0; i < set->count; i++) {
+        unlink(set->preambles[i].header);
+        unlink(set->preambles[i].pch);
+        free(set->preambles[i].header);
+        free(set->preambles[i].pch);
+    }
+    for (size_t i = 0; i < set->nentries; i++) {
+        for (size_t j = 0; j < set->entries[i].nincludes; j++)
+            free(set->entries[i].includes[j]);
+        free(set->entries[i].includes);
+    }
+    if (set->dir[0]) rmdir(set->dir);
+    free(set->preambles);
+    free(set->entries);
 }
 
 static void merge_move_callgraph(struct callgraph *dst, struct callgraph *src) {
-    /* Just add all information from one source
-     * to another, it takes linear time */
+    /* Nodes are moved from one graph to another without
+     * copying and rehashing, only duplicates are merged
+     * into the existing nodes and dropped. It takes time linear
+     * in the number of nodes and edges of the duplicates.
+     * NOTE: Files only have calls lists in lod_file mode,
+     * after the graph is filtered, so they are not merged */
+    ht_iter_t itfile = ht_begin(&src->files);
+    for (ht_head_t *cur; (cur = ht_erase_current(&itfile)); ) {
+        struct file *sfile = container_of(cur, struct file, head);
+        ht_head_t **h = ht_lookup_ptr(&dst->files, cur);
+        if (!*h) {
+            ht_insert_hint(&dst->files, h, cur);
+            continue;
+        }
+
+        struct file *dfile = container_of(*h, struct file, head);
+        list_iter_t it = list_begin(&sfile->functions);
+        for (list_head_t *curfun; (curfun = list_next(&it)); )
+            container_of(curfun, struct function, in_file)->file = dfile;
+        list_splice(&dfile->functions, &sfile->functions);
+    }
+
     ht_iter_t itfun = ht_begin(&src->functions);
-    for (ht_head_t *cur; (cur = ht_next(&itfun)); ) {
+    for (ht_head_t *cur; (cur = ht_erase_current(&itfun)); ) {
         struct function *sfun = container_of(cur, struct function, head);
-        struct function *dfun = add_function_ref(dst, sfun->name);
+        ht_head_t **h = ht_lookup_ptr(&dst->functions, cur);
+        if (!*h) {
+            ht_insert_hint(&dst->functions, h, cur);
+            continue;
+        }
+
+        struct function *dfun = container_of(*h, struct function, head);
+        /* Same definition was parsed into both graphs, so its
+         * calls are already in dst. Bodies of definitions which were
+         * visited before are skipped, so these have no calls. Files
+         * are merged above, so they can be compared directly */
+        bool same_body = dfun->is_definition && sfun->is_definition && dfun->file == sfun->file &&
+                dfun->line == sfun->line && dfun->column == sfun->column && !list_is_empty(&dfun->calls);
+
         /* Collect missing information to dst */
         if (!dfun->is_definition && sfun->file) {
             if (dfun->file) list_erase(&dfun->in_file);
-            dfun->file = add_file(dst, sfun->file->name);
+            dfun->file = sfun->file;
             list_append(&dfun->file->functions, &dfun->in_file);
             dfun->line = sfun->line;
             dfun->column = sfun->column;
@@ -243,19 +1479,55 @@ static void merge_move_callgraph(struct callgraph *dst, struct callgraph *src) {
             dfun->is_inline = sfun->is_inline;
             dfun->is_extern = sfun->is_extern;
         }
-        /* Collect missing edges to dst */
-        /* We only need to iterate through calls list,
-         * but not through called list, because if element
-         * is in one list it will be in the other list for some function
-         * NOTE: Edges for inline functions from header files
-         * into multiple source files are duplicated and fileterd
-         * later in filter.c, collapse_duplicates() */
+
+        /* Edges of the duplicate are relinked to the existing node,
+         * dropped calls are unlinked and freed when calls are moved */
         list_iter_t it = list_begin(&sfun->calls);
         for (list_head_t *curcall; (curcall = list_next(&it)); ) {
             struct call *call = container_of(curcall, struct call, calls);
-            struct function *to = add_function_ref(dst, call->callee->name);
-            add_function_call(dfun, to, call->line, call->column);
+            if (same_body) {
+                list_erase(&call->called);
+                call->caller = NULL;
+            } else {
+                call->caller = dfun;
+            }
         }
+        if (!same_body) list_splice(&dfun->calls, &sfun->calls);
+        it = list_begin(&sfun->called);
+        for (list_head_t *curcall; (curcall = list_next(&it)); )
+            container_of(curcall, struct call, called)->callee = dfun;
+        list_splice(&dfun->called, &sfun->called);
+
+        list_erase(&sfun->in_file);
+    }
+
+    /* Now all calls refer to the nodes of dst, calls
+     * between the same functions are merged into one */
+    ht_iter_t itcall = ht_begin(&src->calls);
+    for (ht_head_t *cur; (cur = ht_erase_current(&itcall)); ) {
+        struct call *call = container_of(cur, struct call, head);
+        if (call->caller) {
+            ht_head_t **h = ht_lookup_ptr(&dst->calls, cur);
+            if (!*h) {
+                ht_insert_hint(&dst->calls, h, cur);
+                continue;
+            }
+            count_call(container_of(*h, struct call, head), call->weight);
+            list_erase(&call->calls);
+            list_erase(&call->called);
+        }
+        call->next_free = dst->free_calls;
+        dst->free_calls = call;
+    }
+
+    /* Moved nodes are still in the arena of src */
+    arena_adopt(&dst->arena, &src->arena);
+    if (src->free_calls) {
+        struct call *last = src->free_calls;
+        while (last->next_free) last = last->next_free;
+        last->next_free = dst->free_calls;
+        dst->free_calls = src->free_calls;
+        src->free_calls = NULL;
     }
 }
 
@@ -267,13 +1539,34 @@ struct merge_arg {
 static bool eq_file(const ht_head_t *a, const ht_head_t *b) {
     const struct file *af = container_of(a, const struct file, head);
     const struct file *bf = container_of(b, const struct file, head);
-    return !strcmp(af->name, bf->name);
+    return af->name == bf->name;
 }
 
 static bool eq_function(const ht_head_t *a, const ht_head_t *b) {
     const struct function *af = container_of(a, const struct function, head);
     const struct function *bf = container_of(b, const struct function, head);
-    return !strcmp(af->name, bf->name);
+    return af->name == bf->name;
+}
+
+static bool eq_call(const ht_head_t *a, const ht_head_t *b) {
+    const struct call *ac = container_of(a, const struct call, head);
+    const struct call *bc = container_of(b, const struct call, head);
+    return ac->caller == bc->caller && ac->callee == bc->callee &&
+            (!config.call_sites || (ac->line == bc->line && ac->column == bc->column));
+}
+
+static bool eq_function_usr(const ht_head_t *a, const ht_head_t *b) {
+    const struct function *af = container_of(a, const struct function, head);
+    const struct function *bf = container_of(b, const struct function, head);
+    return af->usr == bf->usr;
+}
+
+struct callgraph *create_callgraph(void) {
+    struct callgraph *cg = calloc(1, sizeof *cg);
+    ht_init(&cg->functions, HT_INIT_CAPS, config.function_identity == id_usr ? eq_function_usr : eq_function);
+    ht_init(&cg->files, HT_INIT_CAPS, eq_file);
+    ht_init(&cg->calls, HT_INIT_CAPS, eq_call);
+    return cg;
 }
 
 static void do_merge_parallel(int thread_index, void *varg) {
@@ -283,13 +1576,113 @@ static void do_merge_parallel(int thread_index, void *varg) {
     free_callgraph(arg->src);
 }
 
+static void init_project_root(void) {
+    if (!config.project_root) return;
+
+    char *root = *config.project_root ? realpath(config.project_root, NULL) : NULL;
+    if (!root) warn("Cannot resolve project root '%s', ignoring", config.project_root);
+    free(config.project_root);
+    config.project_root = root;
+}
+
+static struct callgraph *merge_parts(struct callgraph **cgparts) {
+    size_t n = nproc;
+    while (n > 1) {
+        size_t cnt = n/2, off = (n+1)/2;
+        do {
+            debug("Merging %zd into %zd", cnt + off - 1, cnt - 1);
+            struct merge_arg arg = { cgparts[cnt - 1], cgparts[cnt + off - 1] };
+            submit_work(do_merge_parallel, &arg, sizeof arg);
+        } while (--cnt > 0);
+        drain_work();
+        n = off;
+    }
+
+    return cgparts[0];
+}
+
+struct load_arg {
+    struct callgraph **cgparts;
+    const char *path;
+};
+
+static void do_load(int thread_index, void *varg) {
+    struct load_arg *arg = varg;
+
+    /* Merged graph is useless without any of the parts */
+    FILE *in = fopen(arg->path, "rb");
+    if (!in) die("Cannot open partial graph '%s'", arg->path);
+
+    syncdebug("Loading partial graph '%s'", arg->path);
+    if (!load_callgraph(arg->cgparts[thread_index], in))
+        die("Cannot read partial graph '%s'", arg->path);
+    fclose(in);
+}
+
+struct callgraph *merge_files(char **paths) {
+    struct callgraph *cgparts[nproc];
+    for (ssize_t i = 0; i < nproc; i++)
+        cgparts[i] = create_callgraph();
+
+    for (; *paths; paths++) {
+        struct load_arg arg = { cgparts, *paths };
+        submit_work(do_load, &arg, sizeof arg);
+    }
+    drain_work();
+
+    return merge_parts(cgparts);
+}
+
+/* Sizes tables of the graphs upfront, so that they are not grown
+ * repeatedly while parsing. Sizes of the graph from the previous
+ * run are used if known, otherwise they are guessed from the
+ * number of compile commands */
+static void reserve_parts(struct callgraph **cgparts, const char *path, size_t ncmds) {
+    struct graph_stats stats = {
+        .functions = ncmds * FUNCTIONS_PER_COMMAND,
+        .files = ncmds * FILES_PER_COMMAND,
+        .calls = ncmds * CALLS_PER_COMMAND,
+    };
+    if (cache_load_stats(path, &stats))
+        debug("Previous graph had %"PRIu64" functions, %"PRIu64" files and %"PRIu64" calls",
+              stats.functions, stats.files, stats.calls);
+
+    /* Only the graph everything is merged into reserves
+     * the full size. Other thread graphs end up with most of
+     * the declarations from headers as well, but reserving all
+     * of them would make bucket memory scale with the number
+     * of threads, so they reserve twice their share and grow
+     * incrementally past it. Calls are split between threads */
+    for (ssize_t i = 0; i < nproc; i++) {
+        if (!cgparts[i]) continue;
+        uint64_t share = i ? MIN(nproc, 2) : nproc;
+        ht_reserve(&cgparts[i]->functions, stats.functions * share / nproc);
+        ht_reserve(&cgparts[i]->files, stats.files * share / nproc);
+        ht_reserve(&cgparts[i]->calls, config.shared_graph ? stats.calls : stats.calls / nproc);
+    }
+}
+
 struct callgraph *parse_directory(const char *path) {
+    init_cache();
+    /* Resolved root is a part of the cache keys */
+    init_project_root();
+
+    if (config.shared_graph && config.cache_dir) {
+        warn("Shared graph cannot be used with cache, ignoring");
+        config.shared_graph = 0;
+    }
+
+    /* Either every thread has its own graph,
+     * which are merged in the end, or all of them
+     * insert into the same one */
     struct callgraph *cgparts[nproc];
+    struct parse_thread threads[nproc];
     for (ssize_t i = 0; i < nproc; i++) {
-        cgparts[i] = calloc(1, sizeof *cgparts[0]);
-        ht_init(&cgparts[i]->functions, HT_INIT_CAPS, eq_function);
-        ht_init(&cgparts[i]->files, HT_INIT_CAPS, eq_file);
+        cgparts[i] = !i || !config.shared_graph ? create_callgraph() : NULL;
+        threads[i] = (struct parse_thread) { .callgraph = cgparts[config.shared_graph ? 0 : i] };
     }
+    if (config.shared_graph)
+        make_shared(cgparts[0]);
 
     CXCompilationDatabase_Error err = CXCompilationDatabase_NoError;
     CXCompilationDatabase cdb = clang_CompilationDatabase_fromDirectory(path, &err);
@@ -298,36 +1691,56 @@ struct callgraph *parse_directory(const char *path) {
         return NULL;
     }
 
-    char buf[PATH_MAX + 1];
-    char *res = getcwd(buf, sizeof buf - 1);
     CXCompileCommands ccmds = clang_CompilationDatabase_getAllCompileCommands(cdb);
+    size_t ncmds = clang_CompileCommands_getSize(ccmds);
+    struct command *cmds = load_commands(ccmds, &ncmds);
+    clang_CompileCommands_dispose(ccmds);
+    clang_CompilationDatabase_dispose(cdb);
+    reserve_parts(cgparts, path, ncmds);
+    init_visited();
 
-    ssize_t ncmds = clang_CompileCommands_getSize(ccmds);
-    for (ssize_t offset = 0; ncmds > offset; offset += BATCH_SIZE) {
-        struct arg arg = {
-            .pres = cgparts,
-            .cmds = ccmds,
-            .offset = offset,
-            .size = MIN(BATCH_SIZE, ncmds - offset)
-        };
-        submit_work(do_parse, &arg, sizeof arg);
-    }
-    drain_work();
+    struct preamble_set preambles;
+    init_preambles(&preambles, threads, cmds, ncmds);
 
-    size_t n = nproc;
-    while (n > 1) {
-        size_t cnt = n/2, off = (n+1)/2;
-        do {
-            debug("Merging %zd into %zd", cnt + off - 1, cnt - 1);
-            struct merge_arg arg = { cgparts[cnt - 1], cgparts[cnt + off - 1] };
-            submit_work(do_merge_parallel, &arg, sizeof arg);
-        } while (--cnt > 0);
+    size_t next = 0;
+    struct command **order = schedule_commands(cmds, ncmds);
+    if (config.nprocesses) {
+        parse_in_processes(order, ncmds, cgparts[0]);
+    } else {
+        for (ssize_t i = 0; i < nproc; i++) {
+            struct arg arg = {
+                .threads = threads,
+                .order = order,
+                .next = &next,
+                .size = ncmds,
+            };
+            submit_work(do_parse, &arg, sizeof arg);
+        }
         drain_work();
-        n = off;
     }
+    free(order);
+    fini_preambles(&preambles);
+    free_commands(cmds, ncmds);
 
-    clang_CompileCommands_dispose(ccmds);
-    clang_CompilationDatabase_dispose(cdb);
-    if (res) chdir(buf);
-    return cgparts[0];
+    for (ssize_t i = 0; i < nproc; i++)
+        if (threads[i].index) clang_disposeIndex(threads[i].index);
+    fini_visited();
+
+    struct callgraph *cg;
+    if (config.shared_graph) {
+        for (ssize_t i = 0; i < nproc; i++)
+            arena_adopt(&cgparts[0]->arena, &threads[i].arena);
+        unmake_shared(cgparts[0]);
+        cg = cgparts[0];
+    } else {
+        cg = merge_parts(cgparts);
+    }
+
+    struct graph_stats stats = {
+        .functions = cg->functions.size,
+        .files = cg->files.size,
+        .calls = cg->calls.size,
+    };
+    cache_store_stats(path, &stats);
+    return cg;
 }
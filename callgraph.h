@@ -4,10 +4,12 @@
 #define CALLGRAPH_H_ 1
 
 #include "hashtable.h"
+#include "intern.h"
 #include "list.h"
 #include "util.h"
 
 #include <stddef.h>
+#include <stdio.h>
 
 
 struct file {
@@ -18,8 +20,13 @@ struct file {
     const char *name;
 };
 
+/* Functions are identified either by their display name
+ * (head.hash is the hash of the name) or by their USR,
+ * then head.hash and usr together form a 128-bit digest of it.
+ * Names of functions and files are interned */
 struct function {
     ht_head_t head;
+    uint64_t usr;
     struct file *file;
     list_head_t in_file;
     list_head_t called;
@@ -29,11 +36,15 @@ struct function {
     bool is_definition : 1;
     bool is_extern : 1;
     bool is_inline : 1;
-    bool mark : 1;
     const char *name;
 };
 
+/* Calls are unique per caller and callee, weight is the number
+ * of call sites and line and column are of the first one. With
+ * --call-sites every site is a separate call instead, these are
+ * merged by collapse_duplicates() after the graph is frozen */
 struct call {
+    ht_head_t head;
     union {
         struct {
             struct function *caller;
@@ -43,6 +54,8 @@ struct call {
             struct file *from_file;
             struct file *to_file;
         };
+        /* Erased calls are reused */
+        struct call *next_free;
     };
     list_head_t called;
     list_head_t calls;
@@ -51,64 +64,46 @@ struct call {
     float weight;
 };
 
+/* All nodes of the graph are allocated from its arena.
+ * Erased calls are kept in the free list for reuse,
+ * while erased functions and files are just left unused
+ * until the whole graph is freed */
 struct callgraph {
     struct hashtable functions;
     struct hashtable files;
+    struct hashtable calls;
+    struct arena arena;
+    struct call *free_calls;
+    /* Locks, only present while the graph
+     * is filled by multiple threads at once */
+    struct shared_graph *shared;
 };
 
-inline static void erase_call(struct call *call) {
-    if (call->called.next)
-        list_erase(&call->called);
-    if (call->calls.next)
-        list_erase(&call->calls);
-    free(call);
-}
-
-inline static void erase_function(struct callgraph *cg, struct function *fun) {
-    list_iter_t it = list_begin(&fun->calls);
-    for (list_head_t *cur; (cur = list_next(&it)); )
-        erase_call(container_of(cur, struct call, calls));
-    it = list_begin(&fun->called);
-    for (list_head_t *cur; (cur = list_next(&it)); )
-        erase_call(container_of(cur, struct call, called));
-    list_erase(&fun->in_file);
-    ht_erase(&cg->functions, &fun->head);
-    free(fun);
+inline static struct call *alloc_call(struct callgraph *cg) {
+    struct call *call = cg->free_calls;
+    if (!call) return arena_alloc(&cg->arena, sizeof *call);
+    cg->free_calls = call->next_free;
+    return call;
 }
 
-inline static void erase_file(struct callgraph *cg, struct file *file) {
-    list_iter_t it = list_begin(&file->functions);
-    for (list_head_t *cur; (cur = list_next(&it)); )
-        erase_function(cg, container_of(cur, struct function, in_file));
-    it = list_begin(&file->calls);
-    for (list_head_t *cur; (cur = list_next(&it)); )
-        erase_call(container_of(cur, struct call, calls));
-    it = list_begin(&file->called);
-    for (list_head_t *cur; (cur = list_next(&it)); )
-        erase_call(container_of(cur, struct call, called));
-    ht_erase(&cg->files, &file->head);
-    free(file);
-}
+#define USR_SEED 0x9E3779B97F4A7C15LLU
 
-inline static struct file *find_file(struct callgraph *cg, const char *file) {
-    size_t len = strlen(file);
-    struct file dummy = { .head.hash = hash64(file, len), .name = file };
-    return container_of(ht_find(&cg->files, &dummy.head), struct file, head);
-}
-
-inline static  struct function *find_function(struct callgraph *cg, const char *function) {
-    size_t len = strlen(function);
-    struct function dummy = { .head.hash = hash64(function, len), .name = function };
-    return container_of(ht_find(&cg->functions, &dummy.head), struct function, head);
+inline static struct function function_key(const char *name) {
+    const char *str = intern_string(name);
+    return (struct function) { .head.hash = interned_hash(str), .name = str };
 }
 
+struct callgraph *create_callgraph(void);
 void free_callgraph(struct callgraph *cg);
 struct callgraph *parse_directory(const char *path);
+struct callgraph *merge_files(char **paths);
+struct file *add_file(struct callgraph *cg, const char *file);
+struct function *add_function_ref(struct callgraph *cg, const struct function *key);
+
+bool save_callgraph(struct callgraph *cg, FILE *out);
+bool load_callgraph(struct callgraph *dst, FILE *in);
 
-void dump_dot(struct callgraph *cg, const char *destpath);
-void filter_graph(struct callgraph *cg);
-void clear_marks(struct callgraph *cg);
-void add_function_call(struct function *from, struct function *to, int line, int col);
+struct call *add_function_call(struct callgraph *cg, struct function *from, struct function *to, int line, int col, float weight);
 
 #endif
 
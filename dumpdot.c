@@ -1,14 +1,15 @@
 /* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
 
 #include "util.h"
-#include "callgraph.h"
+#include "frozen.h"
 
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 
 #define MAX_WEIGHT 16
 
-static void dump_dot_functions(struct callgraph *cg, FILE *dst) {
+static void dump_dot_functions(struct frozen_graph *fg, FILE *dst) {
     fputs("digraph \"callgraph\" {\n", dst);
 
     // TODO Make more of these configurable
@@ -21,53 +22,43 @@ static void dump_dot_functions(struct callgraph *cg, FILE *dst) {
     fprintf(dst, "\tnode[shape=\"%s\" style=\"%s\" color=\"%s\"]\n", "box", "filled", "white");
 
     /* Print functions for each file */
-    ht_iter_t itfile = ht_begin(&cg->files);
-    for (ht_head_t *cur; (cur = ht_next(&itfile)); ) {
-        struct file *file = container_of(cur, struct file, head);
-        if (list_is_empty(&file->functions)) continue;
-        fprintf(dst, "\tsubgraph \"cluster_%s\" {\n", file->name);
+    for (uint32_t file = 0; file < fg->nfiles; file++) {
+        if (fg->file_first[file] == fg->file_first[file + 1]) continue;
+        fprintf(dst, "\tsubgraph \"cluster_%s\" {\n", fg->file_names[file]);
         fprintf(dst, "\t\tstyle = \"%s\";\n", "dotted,filled");
         fprintf(dst, "\t\tcolor = \"%s\";\n", "lightgray");
-        fprintf(dst, "\t\tlabel = \"%s\";\n", file->name);
-
-        list_iter_t itfun = list_begin(&file->functions);
-        for (list_head_t *curfun; (curfun = list_next(&itfun)); ) {
-            struct function *fun = container_of(curfun, struct function, in_file);
-            fprintf(dst, "\t\tn%p[label=\"%s\"];\n", (void *)fun, fun->name);
-
-            list_iter_t itcall = list_begin(&fun->calls);
-            for (list_head_t *curcall; (curcall = list_next(&itcall)); ) {
-                struct call *call = container_of(curcall, struct call, calls);
-                if (call->caller->file != call->callee->file) continue;
-                fprintf(dst, "\t\tn%p -> n%p[style = \"setlinewidth(%f)\"];\n",
-                        (void *)call->caller, (void *)call->callee, MIN(pow(call->weight, 0.6), MAX_WEIGHT));
+        fprintf(dst, "\t\tlabel = \"%s\";\n", fg->file_names[file]);
+
+        for (uint32_t fun = fg->file_first[file]; fun < fg->file_first[file + 1]; fun++) {
+            fprintf(dst, "\t\tn%"PRIu32"[label=\"%s\"];\n", fun, fg->names[fun]);
+
+            for (uint32_t e = fg->out_first[fun]; e < fg->out_first[fun + 1]; e++) {
+                if (fg->file[fg->callee[e]] != file) continue;
+                fprintf(dst, "\t\tn%"PRIu32" -> n%"PRIu32"[style = \"setlinewidth(%f)\"];\n",
+                        fun, fg->callee[e], MIN(pow(fg->weight[e], 0.6), MAX_WEIGHT));
             }
         }
         fputs("\t}\n", dst);
     }
 
     /* Print all edges between files */
-    ht_iter_t itfun = ht_begin(&cg->functions);
-    for (ht_head_t *cur; (cur = ht_next(&itfun)); ) {
-        struct function *fun = container_of(cur, struct function, head);
-        if (!fun->file) {
+    for (uint32_t fun = 0; fun < fg->nfunctions; fun++) {
+        if (fg->file[fun] == FROZEN_NONE) {
             // Built-in functions are not defined anywhere...
-            fprintf(dst, "\t\tn%p[label=\"%s\"];\n", (void *)fun, fun->name);
+            fprintf(dst, "\t\tn%"PRIu32"[label=\"%s\"];\n", fun, fg->names[fun]);
         }
 
-        list_iter_t itcall = list_begin(&fun->calls);
-        for (list_head_t *curcall; (curcall = list_next(&itcall)); ) {
-            struct call *call = container_of(curcall, struct call, calls);
-            if (call->caller->file == call->callee->file) continue;
-            fprintf(dst, "\t\tn%p -> n%p[style = \"setlinewidth(%f)\"];\n",
-                    (void *)call->caller, (void *)call->callee, MIN(pow(call->weight, 0.6), MAX_WEIGHT));
+        for (uint32_t e = fg->out_first[fun]; e < fg->out_first[fun + 1]; e++) {
+            if (fg->file[fun] == fg->file[fg->callee[e]]) continue;
+            fprintf(dst, "\t\tn%"PRIu32" -> n%"PRIu32"[style = \"setlinewidth(%f)\"];\n",
+                    fun, fg->callee[e], MIN(pow(fg->weight[e], 0.6), MAX_WEIGHT));
         }
     }
 
     fputs("}\n", dst);
 }
 
-static void dump_dot_files(struct callgraph *cg, FILE *dst) {
+static void dump_dot_files(struct frozen_graph *fg, FILE *dst) {
     fputs("digraph \"callgraph\" {\n", dst);
 
     // TODO Make more of these configurable
@@ -79,25 +70,21 @@ static void dump_dot_files(struct callgraph *cg, FILE *dst) {
     fprintf(dst, "\toutputorder = \"%s\";\n", "edgesfirst");
     fprintf(dst, "\tnode[shape=\"%s\" style=\"%s\" color=\"%s\"]\n", "box", "filled", "white");
 
-    /* Print functions for each file */
-    ht_iter_t itfile = ht_begin(&cg->files);
-    for (ht_head_t *cur; (cur = ht_next(&itfile)); ) {
-        struct file *file = container_of(cur, struct file, head);
-        if (list_is_empty(&file->functions)) continue;
-        fprintf(dst, "\t\tn%p[label=\"%s\"];\n", (void *)file, file->name);
-
-        list_iter_t itcall = list_begin(&file->calls);
-        for (list_head_t *curcall; (curcall = list_next(&itcall)); ) {
-            struct call *call = container_of(curcall, struct call, calls);
-            fprintf(dst, "\t\tn%p -> n%p[style = \"setlinewidth(%f)\"];\n",
-                    (void *)call->from_file, (void *)call->to_file, MIN(pow(call->weight, 0.6), MAX_WEIGHT));
+    /* Print each file with its dependencies */
+    for (uint32_t file = 0; file < fg->nfiles; file++) {
+        if (fg->file_first[file] == fg->file_first[file + 1]) continue;
+        fprintf(dst, "\t\tn%"PRIu32"[label=\"%s\"];\n", file, fg->file_names[file]);
+
+        for (uint32_t d = fg->dep_first[file]; d < fg->dep_first[file + 1]; d++) {
+            fprintf(dst, "\t\tn%"PRIu32" -> n%"PRIu32"[style = \"setlinewidth(%f)\"];\n",
+                    file, fg->dep_to[d], MIN(pow(fg->dep_weight[d], 0.6), MAX_WEIGHT));
         }
     }
 
     fputs("}\n", dst);
 }
 
-void dump_dot(struct callgraph *cg, const char *destpath) {
+void dump_dot(struct frozen_graph *fg, const char *destpath) {
     FILE *dst = destpath ? fopen(destpath, "w") : stdout;
     if (!dst) {
         warn("Cannot open output file '%s'", destpath);
@@ -106,11 +93,28 @@ void dump_dot(struct callgraph *cg, const char *destpath) {
 
     debug("Writing graph to '%s'...", destpath ? destpath : "<stdout>");
 
-    if (config.level_of_details == lod_file) dump_dot_files(cg, dst);
-    else dump_dot_functions(cg, dst);
+    if (config.level_of_details == lod_file) dump_dot_files(fg, dst);
+    else dump_dot_functions(fg, dst);
 
     debug("Done.");
 
     if (dst != stdout) fclose(dst);
 }
 
+/* Name sets for bench/ */
+void dump_names(struct frozen_graph *fg, const char *destpath) {
+    FILE *dst = fopen(destpath, "w");
+    if (!dst) {
+        warn("Cannot open names file '%s'", destpath);
+        return;
+    }
+
+    debug("Writing names to '%s'...", destpath);
+
+    for (uint32_t fun = 0; fun < fg->nfunctions; fun++)
+        fprintf(dst, "%s\n", fg->names[fun]);
+    for (uint32_t file = 0; file < fg->nfiles; file++)
+        fprintf(dst, "%s\n", fg->file_names[file]);
+
+    if (fclose(dst)) warn("Cannot write names file '%s'", destpath);
+}
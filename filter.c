@@ -1,271 +1,696 @@
 /* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
 
 #include "util.h"
-#include "callgraph.h"
+#include "frozen.h"
+#include "worker.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-void clear_marks(struct callgraph *cg) {
-    ht_iter_t it = ht_begin(&cg->functions);
-    for (ht_head_t *cur; (cur = ht_next(&it)); ) {
-        struct function *function = container_of(cur, struct function, head);
-        function->mark = 0;
-    }
-}
+struct site {
+    uint32_t callee;
+    int32_t line;
+    int32_t column;
+    float weight;
+};
+
+static void exclude_exceptions(struct frozen_graph *fg) {
+    uint8_t *keep = malloc(fg->nfunctions + 1);
+    bool changed = 0;
+
+    memset(keep, 1, fg->nfunctions);
 
-static void exclude_exceptions(struct callgraph *cg) {
     for (size_t i = 0; i < config.exclude_files.size; i++) {
-        struct file *file = find_file(cg, config.exclude_files.data[i]);
-        if (!file) continue;
+        uint32_t file = find_frozen_file(fg, config.exclude_files.data[i]);
+        if (file == FROZEN_NONE) continue;
 
-        debug("Excluding file '%s'", file ? file->name : "<NULL>");
-        erase_file(cg, file);
+        debug("Excluding file '%s'", fg->file_names[file]);
+        memset(keep + fg->file_first[file], 0, fg->file_first[file + 1] - fg->file_first[file]);
+        changed = 1;
     }
 
     for (size_t i = 0; i < config.exclude_functions.size; i++) {
-        struct function *function = find_function(cg, config.exclude_functions.data[i]);
-        if (!function) continue;
-
-        debug("Excluding function '%s'", function ? function->name : "<NULL>");
-        erase_function(cg, function);
+        const char *name = config.exclude_functions.data[i];
+        for (uint32_t fun = find_frozen_function(fg, name, 0); fun != FROZEN_NONE;
+             fun = find_frozen_function(fg, name, fun + 1)) {
+            debug("Excluding function '%s'", fg->names[fun]);
+            keep[fun] = 0;
+            changed = 1;
+        }
     }
-}
 
-static void dfs(struct function *root) {
-    if (root->mark) return;
-    root->mark = 1;
-    list_iter_t it = list_begin(&root->calls);
-    for (list_head_t *cur; (cur = list_next(&it)); ) {
-        struct call *edge = container_of(cur, struct call, calls);
-        dfs(edge->callee);
-    }
+    if (changed) remove_frozen_functions(fg, keep);
+    free(keep);
 }
+/* Functions reached during one level of the traversal */
+struct node_buffer {
+    uint32_t *data;
+    size_t size;
+    size_t caps;
+};
+
+struct reach_arg {
+    /* Either calls or callers */
+    const uint32_t *first;
+    const uint32_t *adj;
+    /* Root sets reaching each function, one bit per set,
+     * NULL when only the union of the sets is needed */
+    uint64_t *mask;
+    /* Functions already added to the next frontier, one bit each,
+     * without masks it is every reached function */
+    uint64_t *queued;
+    const uint32_t *frontier;
+    size_t chunk;
+    struct node_buffer *next;
+};
+
+static void do_reach(int thread_index, size_t start, size_t end, void *varg) {
+    struct reach_arg *arg = varg;
+    struct node_buffer *buf = &arg->next[start / arg->chunk];
+    (void)thread_index;
+
+    for (size_t i = start; i < end; i++) {
+        uint32_t fun = arg->frontier[i];
+        uint64_t bits = arg->mask ? __atomic_load_n(&arg->mask[fun], __ATOMIC_RELAXED) : 0;
+        for (uint32_t e = arg->first[fun]; e < arg->first[fun + 1]; e++) {
+            uint32_t to = arg->adj[e];
+
+            /* Most neighbours are already reached by the same sets,
+             * so check before writing to the shared cache line */
+            if (arg->mask) {
+                uint64_t old = __atomic_load_n(&arg->mask[to], __ATOMIC_RELAXED);
+                if ((old & bits) == bits) continue;
+                old = __atomic_fetch_or(&arg->mask[to], bits, __ATOMIC_RELAXED);
+                if ((old & bits) == bits) continue;
+            }
 
-static void reverse_dfs(struct function *root) {
-    if (root->mark) return;
-    root->mark = 1;
-    list_iter_t it = list_begin(&root->calls);
-    for (list_head_t *cur; (cur = list_next(&it)); ) {
-        struct call *edge = container_of(cur, struct call, calls);
-        reverse_dfs(edge->callee);
+            /* New bits are propagated on the next level */
+            uint64_t bit = 1ULL << (to % 64);
+            if (__atomic_load_n(&arg->queued[to / 64], __ATOMIC_RELAXED) & bit) continue;
+            if (__atomic_fetch_or(&arg->queued[to / 64], bit, __ATOMIC_RELAXED) & bit) continue;
+
+            bool res = adjust_buffer((void **)&buf->data, &buf->caps, buf->size + 1, sizeof *buf->data);
+            assert(res);
+            buf->data[buf->size++] = to;
+        }
     }
 }
 
-static void remove_unused(struct callgraph *cg) {
-    /* Mark every function starting from roots */
-
-    for (size_t i = 0; i < config.root_files.size; i++) {
-        struct file *file = find_file(cg, config.root_files.data[i]);
-        if (file) {
-            list_iter_t it = list_begin(&file->functions);
-            for (list_head_t *cur; (cur = list_next(&it)); ) {
-                struct function *fun = container_of(cur, struct function, in_file);
-                debug("Makring root '%s'", fun->name);
-                dfs(fun);
-            }
+/* Propagates masks of the initial frontier along the calls,
+ * or from callees to callers if reverse is set. Every level
+ * of the traversal is split between the workers, function
+ * is processed again only when it gets new bits, so up to
+ * 64 root sets cost about the same as a single one.
+ * Without masks every function is processed once */
+static void reach_frozen(struct frozen_graph *fg, bool reverse, uint64_t *mask,
+                         uint64_t *queued, struct node_buffer *frontier) {
+    struct node_buffer *next = NULL;
+    size_t next_caps = 0;
+
+    for (size_t level = 0; frontier->size; level++) {
+        size_t n = frontier->size;
+        size_t chunk = parallel_chunk(n, FROZEN_CHUNK / 4);
+        size_t nchunks = (n + chunk - 1) / chunk;
+
+        if (mask) {
+            for (size_t i = 0; i < n; i++)
+                queued[frontier->data[i] / 64] &= ~(1ULL << (frontier->data[i] % 64));
         }
-    }
 
-    for (size_t i = 0; i < config.root_functions.size; i++) {
-        struct function *fun = find_function(cg, config.root_functions.data[i]);
-        if (fun) {
-            debug("Makring root '%s'", fun->name);
-            dfs(fun);
+        bool res = adjust_buffer((void **)&next, &next_caps, nchunks, sizeof *next);
+        assert(res);
+        memset(next, 0, nchunks * sizeof *next);
+
+        struct reach_arg arg = {
+            .first = reverse ? fg->in_first : fg->out_first,
+            .adj = reverse ? fg->caller : fg->callee,
+            .mask = mask,
+            .queued = queued,
+            .frontier = frontier->data,
+            .chunk = chunk,
+            .next = next,
+        };
+        parallel_for(n, chunk, do_reach, &arg);
+
+        frontier->size = 0;
+        for (size_t i = 0; i < nchunks; i++) {
+            res = adjust_buffer((void **)&frontier->data, &frontier->caps,
+                                frontier->size + next[i].size, sizeof *frontier->data);
+            assert(res);
+            if (next[i].size)
+                memcpy(frontier->data + frontier->size, next[i].data, next[i].size * sizeof *next[i].data);
+            frontier->size += next[i].size;
+            free(next[i].data);
         }
+
+        debug("Reachability level %zu: %zu functions", level, frontier->size);
     }
 
-    for (size_t i = 0; i < config.reverse_root_files.size; i++) {
-        struct file *file = find_file(cg, config.reverse_root_files.data[i]);
-        if (file) {
-            list_iter_t it = list_begin(&file->functions);
-            for (list_head_t *cur; (cur = list_next(&it)); ) {
-                struct function *fun = container_of(cur, struct function, in_file);
-                debug("Makring reverse root '%s'", fun->name);
-                reverse_dfs(fun);
-            }
+    free(next);
+}
+
+static void add_root(struct node_buffer *frontier, uint64_t *mask, uint64_t *queued, uint32_t fun, uint64_t bit) {
+    if (mask) mask[fun] |= bit;
+    if (queued[fun / 64] & (1ULL << (fun % 64))) return;
+    queued[fun / 64] |= 1ULL << (fun % 64);
+
+    bool res = adjust_buffer((void **)&frontier->data, &frontier->caps, frontier->size + 1, sizeof *frontier->data);
+    assert(res);
+    frontier->data[frontier->size++] = fun;
+}
+
+/* One root option value */
+struct root_set {
+    const char *name;
+    bool file;
+};
+
+static void add_root_set(struct frozen_graph *fg, struct node_buffer *frontier, uint64_t *mask,
+                         uint64_t *queued, struct root_set *set, uint64_t bit) {
+    if (set->file) {
+        uint32_t file = find_frozen_file(fg, set->name);
+        if (file == FROZEN_NONE) return;
+        for (uint32_t fun = fg->file_first[file]; fun < fg->file_first[file + 1]; fun++) {
+            debug("Makring root '%s'", fg->names[fun]);
+            add_root(frontier, mask, queued, fun, bit);
+        }
+    } else {
+        for (uint32_t fun = find_frozen_function(fg, set->name, 0); fun != FROZEN_NONE;
+             fun = find_frozen_function(fg, set->name, fun + 1)) {
+            debug("Makring root '%s'", fg->names[fun]);
+            add_root(frontier, mask, queued, fun, bit);
         }
     }
+}
 
-    for (size_t i = 0; i < config.reverse_root_functions.size; i++) {
-        struct function *fun = find_function(cg, config.reverse_root_functions.data[i]);
-        if (fun) {
-            debug("Makring reverse root '%s'", fun->name);
-            reverse_dfs(fun);
-        }
+/* Marks functions reached from the root sets in keep.
+ * Masks are only computed when per-set output is requested,
+ * then sets are walked 64 at a time */
+static void reach_sets(struct frozen_graph *fg, bool reverse, struct root_set *sets,
+                       size_t nsets, uint8_t *keep, FILE *out) {
+    uint32_t n = fg->nfunctions;
+    uint64_t *queued = calloc(n / 64 + 1, sizeof *queued);
+    uint64_t *mask = out ? calloc(n + 1, sizeof *mask) : NULL;
+    struct node_buffer frontier = {0};
+
+    if (!out) {
+        for (size_t i = 0; i < nsets; i++)
+            add_root_set(fg, &frontier, NULL, queued, &sets[i], 0);
+
+        reach_frozen(fg, reverse, NULL, queued, &frontier);
+
+        for (uint32_t fun = 0; fun < n; fun++)
+            if (queued[fun / 64] & (1ULL << (fun % 64))) keep[fun] = 1;
     }
 
-    debug("Removing unreachable functions...");
+    for (size_t base = 0; out && base < nsets; base += 64) {
+        size_t batch = MIN(nsets - base, 64);
 
-    ht_iter_t it = ht_begin(&cg->functions);
-    for (ht_head_t *cur; (cur = ht_current(&it)); ) {
-        struct function *fun = container_of(cur, struct function, head);
-        if (!fun->mark) {
-            ht_erase_current(&it);
-            erase_function(cg, fun);
-        } else {
-            ht_next(&it);
+        memset(mask, 0, n * sizeof *mask);
+        for (size_t i = 0; i < batch; i++)
+            add_root_set(fg, &frontier, mask, queued, &sets[base + i], 1ULL << i);
+
+        reach_frozen(fg, reverse, mask, queued, &frontier);
+
+        for (uint32_t fun = 0; fun < n; fun++) {
+            if (mask[fun]) keep[fun] = 1;
+            for (uint64_t bits = mask[fun]; bits; bits &= bits - 1)
+                fprintf(out, "%s\t%s\n", sets[base + __builtin_ctzll(bits)].name, fg->names[fun]);
         }
     }
+
+    free(frontier.data);
+    free(mask);
+    free(queued);
 }
 
-static int cmp_call(const void *a, const void *b) {
-    struct call *call_a = (*(struct call **)a);
-    struct call *call_b = (*(struct call **)b);
+static void remove_unused(struct frozen_graph *fg) {
+    size_t nsets = config.root_files.size + config.root_functions.size;
+    size_t nrsets = config.reverse_root_files.size + config.reverse_root_functions.size;
+    struct root_set *sets = calloc(nsets + nrsets + 1, sizeof *sets);
+    size_t k = 0;
+
+    /* Every root option value is a separate root set */
+
+    for (size_t i = 0; i < config.root_files.size; i++)
+        sets[k++] = (struct root_set){config.root_files.data[i], 1};
+    for (size_t i = 0; i < config.root_functions.size; i++)
+        sets[k++] = (struct root_set){config.root_functions.data[i], 0};
+    for (size_t i = 0; i < config.reverse_root_files.size; i++)
+        sets[k++] = (struct root_set){config.reverse_root_files.data[i], 1};
+    for (size_t i = 0; i < config.reverse_root_functions.size; i++)
+        sets[k++] = (struct root_set){config.reverse_root_functions.data[i], 0};
+
+    FILE *out = NULL;
+    if (config.reach_path) {
+        out = fopen(config.reach_path, "w");
+        if (!out) warn("Cannot open reach file '%s'", config.reach_path);
+        else debug("Writing reached functions to '%s'...", config.reach_path);
+    }
 
-    if (call_a->callee < call_b->callee) return -1;
-    if (call_a->callee > call_b->callee) return 1;
+    uint8_t *keep = calloc(fg->nfunctions + 1, 1);
 
-    // Just compare files by address, they are unique
-    if (call_a->caller->file < call_b->caller->file) return -1;
-    if (call_a->caller->file > call_b->caller->file) return 1;
+    /* Reverse roots keep their callers and are walked separately,
+     * so functions reached by the forward sets are not walked backwards */
+    reach_sets(fg, 0, sets, nsets, keep, out);
+    reach_sets(fg, 1, sets + nsets, nrsets, keep, out);
 
-    if (call_a->line < call_b->line) return -1;
-    if (call_a->line > call_b->line) return 1;
+    if (out && fclose(out)) warn("Cannot write reach file '%s'", config.reach_path);
 
-    if (call_a->column < call_b->column) return -1;
-    if (call_a->column > call_b->column) return 1;
+    debug("Removing unreachable functions...");
 
-    return 0;
+    remove_frozen_functions(fg, keep);
+    free(keep);
+    free(sets);
 }
 
-static int cmp_dep(const void *a, const void *b) {
-    struct call *call_a = (*(struct call **)a);
-    struct call *call_b = (*(struct call **)b);
+static int cmp_site(const void *a, const void *b) {
+    const struct site *site_a = a;
+    const struct site *site_b = b;
+
+    if (site_a->callee < site_b->callee) return -1;
+    if (site_a->callee > site_b->callee) return 1;
+
+    if (site_a->line < site_b->line) return -1;
+    if (site_a->line > site_b->line) return 1;
 
-    if (call_a->to_file < call_b->to_file) return -1;
-    if (call_a->to_file > call_b->to_file) return 1;
+    if (site_a->column < site_b->column) return -1;
+    if (site_a->column > site_b->column) return 1;
 
-    // Just compare files by address, they are unique
-    if (call_a->from_file < call_b->from_file) return -1;
-    if (call_a->from_file > call_b->from_file) return 1;
     return 0;
 }
 
-static void collapse_one_entry(list_iter_t edge, int (*cmp)(const void *, const void *)) {
-    static struct call **buffer = NULL;
-    static size_t bufsize = 0, bufcaps = 0;
-
-    if (!cmp) {
-        free(buffer);
-        bufcaps = 0;
-        buffer = NULL;
-        return;
+/* Sites are sorted as packed keys: callee-line-column,
+ * functions with sites which do not fit are sorted with qsort() */
+#define SITE_LINE_BITS 20
+#define SITE_COLUMN_BITS 12
+
+struct collapse_arg {
+    struct frozen_graph *fg;
+    uint32_t *count;
+};
+
+static bool pack_sites(struct frozen_graph *fg, uint32_t first, size_t n, struct sort_item *items) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t line = fg->line[first + i], column = fg->column[first + i];
+        if (line >> SITE_LINE_BITS || column >> SITE_COLUMN_BITS) return 0;
+        items[i] = (struct sort_item) {
+            .key = (uint64_t)fg->callee[first + i] << 32 | line << SITE_COLUMN_BITS | column,
+            .value = i,
+        };
     }
+    return 1;
+}
 
-    bufsize = 0;
-
-    /* Add all edges to temporary buffer */
-    for (list_head_t *curcall; (curcall = list_next(&edge)); ) {
-        struct call *call = container_of(curcall, struct call, calls);
-        bool res = adjust_buffer((void **)&buffer, &bufcaps, bufsize + 1, sizeof *buffer);
+static void do_collapse_duplicates(int thread_index, size_t start, size_t end, void *varg) {
+    struct collapse_arg *arg = varg;
+    struct frozen_graph *fg = arg->fg;
+    struct site *buffer = NULL;
+    struct sort_item *items = NULL, *tmp = NULL;
+    size_t bufcaps = 0, items_caps = 0, tmp_caps = 0;
+    (void)thread_index;
+
+    /* Calls are compacted within the range of each
+     * function, since it can only lose some of them */
+    for (size_t fun = start; fun < end; fun++) {
+        uint32_t first = fg->out_first[fun], ne = first;
+        size_t bufsize = fg->out_first[fun + 1] - first;
+        arg->count[fun] = 0;
+        if (!bufsize) continue;
+
+        bool res = adjust_buffer((void **)&buffer, &bufcaps, bufsize, sizeof *buffer) &&
+                   adjust_buffer((void **)&items, &items_caps, bufsize, sizeof *items) &&
+                   adjust_buffer((void **)&tmp, &tmp_caps, bufsize, sizeof *tmp);
         assert(res);
-        buffer[bufsize++] = call;
-    }
 
-    if (!bufsize) return;
+        /* Sort them by source location: callee-line-column */
+        bool packed = pack_sites(fg, first, bufsize, items);
+        if (packed) sort_items(items, tmp, bufsize);
+
+        for (size_t i = 0; i < bufsize; i++) {
+            uint32_t e = first + (packed ? items[i].value : i);
+            buffer[i] = (struct site) {
+                .callee = fg->callee[e],
+                .line = fg->line[e],
+                .column = fg->column[e],
+                .weight = fg->weight[e],
+            };
+        }
 
-    /* Sort them by source location: callee-file-function-line-column */
-    qsort(buffer, bufsize, sizeof *buffer, cmp);
+        if (!packed) qsort(buffer, bufsize, sizeof *buffer, cmp_site);
 
-    /* And remove duplicates linearally */
-    for (size_t i = 1; i < bufsize; i++) {
-        if (!cmp_call(&buffer[i - 1], &buffer[i]))
-            erase_call(buffer[i - 1]);
-        else if (buffer[i -1]->callee == buffer[i]->callee) {
-            buffer[i]->weight += buffer[i - 1]->weight;
-            erase_call(buffer[i - 1]);
+        /* And remove duplicates linearally, calls
+         * from the same site are counted once */
+        for (size_t i = 0; i < bufsize; i++) {
+            if (i + 1 < bufsize && buffer[i].callee == buffer[i + 1].callee) {
+                if (cmp_site(&buffer[i], &buffer[i + 1]))
+                    buffer[i + 1].weight += buffer[i].weight;
+                continue;
+            }
+            fg->callee[ne] = buffer[i].callee;
+            fg->line[ne] = buffer[i].line;
+            fg->column[ne] = buffer[i].column;
+            fg->weight[ne] = buffer[i].weight;
+            ne++;
         }
+        arg->count[fun] = ne - first;
     }
+
+    free(tmp);
+    free(items);
+    free(buffer);
 }
 
-static void collapse_duplicates(struct callgraph *cg) {
+static void collapse_duplicates(struct frozen_graph *fg) {
+    uint32_t n = fg->nfunctions;
+    struct collapse_arg arg = {
+        .fg = fg,
+        .count = malloc((n + 1) * sizeof *arg.count),
+    };
+
     debug("Collapsing duplicate edges...");
-    ht_iter_t it = ht_begin(&cg->functions);
-    for (ht_head_t *cur; (cur = ht_next(&it)); ) {
-        struct function *fun = container_of(cur, struct function, head);
-        collapse_one_entry(list_begin(&fun->calls), cmp_call);
-    }
-    collapse_one_entry((list_iter_t){ 0 }, NULL);
+
+    parallel_for(n, parallel_chunk(n, FROZEN_CHUNK), do_collapse_duplicates, &arg);
+    compact_frozen_calls(fg, arg.count);
+    build_frozen_reverse(fg);
+
+    free(arg.count);
 }
 
+/* File level edges of a chunk of files */
+struct dep_buffer {
+    uint32_t *to;
+    float *weight;
+    size_t size;
+    size_t caps_to;
+    size_t caps_weight;
+};
+
+struct condence_arg {
+    struct frozen_graph *fg;
+    size_t chunk;
+    uint32_t *count;
+    struct dep_buffer *chunks;
+    /* Per thread, indexed by file */
+    uint32_t **slot;
+    uint32_t **owner;
+};
+
+static void do_condence(int thread_index, size_t start, size_t end, void *varg) {
+    struct condence_arg *arg = varg;
+    struct frozen_graph *fg = arg->fg;
+    struct dep_buffer *buf = &arg->chunks[start / arg->chunk];
+
+    /* Files are unique, so owners
+     * never need to be reset */
+    if (!arg->owner[thread_index]) {
+        arg->slot[thread_index] = malloc((fg->nfiles + 1) * sizeof **arg->slot);
+        arg->owner[thread_index] = malloc((fg->nfiles + 1) * sizeof **arg->owner);
+        memset(arg->owner[thread_index], 0xFF, (fg->nfiles + 1) * sizeof **arg->owner);
+    }
+    uint32_t *slot = arg->slot[thread_index];
+    uint32_t *owner = arg->owner[thread_index];
+
+    /* Edges between the same pair of files are merged
+     * on the fly, their weights are summed */
+    for (uint32_t file = start; file < end; file++) {
+        size_t first = buf->size;
+        for (uint32_t fun = fg->file_first[file]; fun < fg->file_first[file + 1]; fun++) {
+            for (uint32_t e = fg->out_first[fun]; e < fg->out_first[fun + 1]; e++) {
+                uint32_t to = fg->file[fg->callee[e]];
+                if (to == file || to == FROZEN_NONE) continue;
+                if (owner[to] == file) {
+                    buf->weight[slot[to]] += fg->weight[e];
+                    continue;
+                }
+
+                bool res = adjust_buffer((void **)&buf->to, &buf->caps_to, buf->size + 1, sizeof *buf->to) &&
+                           adjust_buffer((void **)&buf->weight, &buf->caps_weight, buf->size + 1, sizeof *buf->weight);
+                assert(res);
 
-static void collapse_file_duplicates(struct callgraph *cg) {
-    debug("Collapsing duplicate edges for files...");
-    ht_iter_t it = ht_begin(&cg->files);
-    for (ht_head_t *cur; (cur = ht_next(&it)); ) {
-        struct file *file = container_of(cur, struct file, head);
-        collapse_one_entry(list_begin(&file->calls), cmp_dep);
+                owner[to] = file;
+                slot[to] = buf->size;
+                buf->to[buf->size] = to;
+                buf->weight[buf->size++] = fg->weight[e];
+            }
+        }
+        arg->count[file] = buf->size - first;
     }
-    collapse_one_entry((list_iter_t){ 0 }, NULL);
 }
 
+static void condence_file_graph(struct frozen_graph *fg) {
+    uint32_t n = fg->nfiles;
+    size_t chunk = parallel_chunk(n, FROZEN_CHUNK / 16);
+    size_t nchunks = (n + chunk - 1) / chunk;
+    struct condence_arg arg = {
+        .fg = fg,
+        .chunk = chunk,
+        .count = malloc((n + 1) * sizeof *arg.count),
+        .chunks = calloc(nchunks + 1, sizeof *arg.chunks),
+        .slot = calloc(nproc, sizeof *arg.slot),
+        .owner = calloc(nproc, sizeof *arg.owner),
+    };
+
+    debug("Collapsing function nodes...");
+
+    parallel_for(n, chunk, do_condence, &arg);
+
+    fg->dep_first = malloc((n + 1) * sizeof *fg->dep_first);
+    uint32_t ndeps = 0;
+    for (uint32_t file = 0; file < n; file++) {
+        fg->dep_first[file] = ndeps;
+        ndeps += arg.count[file];
+    }
+    fg->dep_first[n] = ndeps;
+
+    /* Chunks are concatenated in order */
+    fg->dep_to = malloc((ndeps + 1) * sizeof *fg->dep_to);
+    fg->dep_weight = malloc((ndeps + 1) * sizeof *fg->dep_weight);
+    fg->ndeps = ndeps;
+    for (size_t i = 0, pos = 0; i < nchunks; i++) {
+        struct dep_buffer *buf = &arg.chunks[i];
+        if (buf->size) {
+            memcpy(fg->dep_to + pos, buf->to, buf->size * sizeof *buf->to);
+            memcpy(fg->dep_weight + pos, buf->weight, buf->size * sizeof *buf->weight);
+        }
+        pos += buf->size;
+        free(buf->to);
+        free(buf->weight);
+    }
 
-inline static void add_file_edge(struct file *from, struct file *to, float weight) {
-    struct call *new = malloc(sizeof *new);
-    list_append(&from->calls, &new->calls);
-    list_append(&to->called, &new->called);
-    new->from_file = from;
-    new->to_file = to;
-    new->weight = weight;
+    for (int i = 0; i < nproc; i++) {
+        free(arg.slot[i]);
+        free(arg.owner[i]);
+    }
+    free(arg.slot);
+    free(arg.owner);
+    free(arg.chunks);
+    free(arg.count);
 }
 
-static void condence_file_graph(struct callgraph *cg) {
-    debug("Collapsing function nodes...");
-    ht_iter_t it = ht_begin(&cg->files);
-    for (ht_head_t *cur; (cur = ht_next(&it)); ) {
-        struct file *file = container_of(cur, struct file, head);
-        list_iter_t itfun = list_begin(&file->functions);
-        for (list_head_t *curfun; (curfun = list_next(&itfun)); ) {
-            struct function *fun = container_of(curfun, struct function, in_file);
-            list_iter_t itcall = list_begin(&fun->calls);
-            for (list_head_t *curcall; (curcall = list_next(&itcall)); ) {
-                struct call *call = container_of(curcall, struct call, calls);
-                if (call->callee->file != file && call->callee->file)
-                    add_file_edge(file, call->callee->file, call->weight);
+/* Calls of a chunk of functions */
+struct site_buffer {
+    struct site *data;
+    size_t size;
+    size_t caps;
+};
+
+static void add_site(struct site_buffer *buf, struct frozen_graph *fg, uint32_t to, uint32_t e) {
+    bool res = adjust_buffer((void **)&buf->data, &buf->caps, buf->size + 1, sizeof *buf->data);
+    assert(res);
+
+    buf->data[buf->size] = (struct site) {
+        .callee = to,
+        .line = fg->line[e],
+        .column = fg->column[e],
+        .weight = fg->weight[e],
+    };
+    buf->size++;
+}
+
+struct inline_arg {
+    struct frozen_graph *fg;
+    const uint8_t *keep;
+    size_t chunk;
+    uint32_t *count;
+    struct site_buffer *chunks;
+    /* Per thread, indexed by function */
+    uint8_t **visited;
+};
+
+static void do_collapse_inline(int thread_index, size_t start, size_t end, void *varg) {
+    struct inline_arg *arg = varg;
+    struct frozen_graph *fg = arg->fg;
+    const uint8_t *keep = arg->keep;
+    struct site_buffer *buf = &arg->chunks[start / arg->chunk];
+    uint32_t *queue = NULL;
+    struct sort_item *items = NULL, *tmp = NULL;
+    size_t queue_caps = 0, items_caps = 0, tmp_caps = 0, sites_caps = 0;
+    struct site *sites = NULL;
+
+    if (!arg->visited[thread_index])
+        arg->visited[thread_index] = calloc(fg->nfunctions + 1, sizeof **arg->visited);
+    uint8_t *visited = arg->visited[thread_index];
+
+    for (uint32_t fun = start; fun < end; fun++) {
+        size_t first = buf->size;
+        arg->count[fun] = 0;
+        if (!keep[fun]) continue;
+
+        /* Direct calls go first to preserve their sites */
+        for (uint32_t e = fg->out_first[fun]; e < fg->out_first[fun + 1]; e++)
+            if (keep[fg->callee[e]]) add_site(buf, fg, fg->callee[e], e);
+
+        for (uint32_t e = fg->out_first[fun]; e < fg->out_first[fun + 1]; e++) {
+            uint32_t root = fg->callee[e];
+            if (keep[root]) continue;
+
+            /* Every collapsed function is visited once per call,
+             * the queue is then used to reset visited marks */
+            size_t head = 0, tail = 0;
+            bool res = adjust_buffer((void **)&queue, &queue_caps, tail + 1, sizeof *queue);
+            assert(res);
+            visited[root] = 1;
+            queue[tail++] = root;
+            while (head < tail) {
+                uint32_t cur = queue[head++];
+                for (uint32_t ec = fg->out_first[cur]; ec < fg->out_first[cur + 1]; ec++) {
+                    uint32_t to = fg->callee[ec];
+                    if (keep[to]) {
+                        add_site(buf, fg, to, e);
+                    } else if (!visited[to]) {
+                        res = adjust_buffer((void **)&queue, &queue_caps, tail + 1, sizeof *queue);
+                        assert(res);
+                        visited[to] = 1;
+                        queue[tail++] = to;
+                    }
+                }
             }
+            for (size_t i = 0; i < tail; i++)
+                visited[queue[i]] = 0;
         }
+
+        /* Calls of the same function are merged, the first
+         * one keeps its site and weights are summed. Sort is
+         * stable, so packed keys only need the callee */
+        size_t nsites = buf->size - first, ne = 0;
+        if (!nsites) continue;
+
+        bool res = adjust_buffer((void **)&items, &items_caps, nsites, sizeof *items) &&
+                   adjust_buffer((void **)&tmp, &tmp_caps, nsites, sizeof *tmp) &&
+                   adjust_buffer((void **)&sites, &sites_caps, nsites, sizeof *sites);
+        assert(res);
+
+        memcpy(sites, buf->data + first, nsites * sizeof *sites);
+        for (size_t i = 0; i < nsites; i++)
+            items[i] = (struct sort_item) { .key = sites[i].callee, .value = i };
+        sort_items(items, tmp, nsites);
+
+        struct site *out = buf->data + first;
+        for (size_t i = 0; i < nsites; i++) {
+            struct site *cur = &sites[items[i].value];
+            if (ne && out[ne - 1].callee == cur->callee)
+                out[ne - 1].weight += cur->weight;
+            else
+                out[ne++] = *cur;
+        }
+        buf->size = first + ne;
+        arg->count[fun] = ne;
     }
+
+    free(sites);
+    free(tmp);
+    free(items);
+    free(queue);
 }
 
-static void collapse_inline(struct callgraph *cg, bool keep_inline, bool keep_static) {
+static void collapse_inline(struct frozen_graph *fg, bool keep_inline, bool keep_static) {
+    uint32_t n = fg->nfunctions;
+    uint8_t *keep = malloc(n + 1);
+    bool changed = 0;
+
     debug("Collapsing inline/static functions...");
-    ht_iter_t it = ht_begin(&cg->functions);
-    for (ht_head_t *cur; (cur = ht_current(&it)); ) {
-        struct function *fun = container_of(cur, struct function, head);
-        if (((keep_inline || !fun->is_inline) && (keep_static || fun->is_extern))) {
-            ht_next(&it);
-            continue;
-        }
-        list_iter_t itfrom = list_begin(&fun->called);
-        for (list_head_t *curfrom; (curfrom = list_erase_current(&itfrom)); ) {
-            struct call *from = container_of(curfrom, struct call, called);
-            if (from->caller != fun) {
-                list_iter_t itto = list_begin(&fun->calls);
-                for (list_head_t *curto; (curto = list_next(&itto)); ) {
-                    struct call *to = container_of(curfrom, struct call, called);
-                    if (to->callee == fun) continue;
-                    add_function_call(from->caller, to->callee, from->line, from->column);
-                }
-            }
-            erase_call(from);
+
+    for (uint32_t fun = 0; fun < n; fun++) {
+        keep[fun] = (keep_inline || !(fg->flags[fun] & fz_inline)) &&
+                    (keep_static || (fg->flags[fun] & fz_extern));
+        changed |= !keep[fun];
+    }
+
+    if (!changed) {
+        free(keep);
+        return;
+    }
+
+    /* Every call of a collapsed function is replaced
+     * with calls of all kept functions reachable through
+     * collapsed ones, which get the site and the weight
+     * of the original call. Calls of the same function
+     * are merged, so that edges are kept unique */
+    size_t chunk = parallel_chunk(n, FROZEN_CHUNK);
+    size_t nchunks = (n + chunk - 1) / chunk;
+    struct inline_arg arg = {
+        .fg = fg,
+        .keep = keep,
+        .chunk = chunk,
+        .count = malloc((n + 1) * sizeof *arg.count),
+        .chunks = calloc(nchunks + 1, sizeof *arg.chunks),
+        .visited = calloc(nproc, sizeof *arg.visited),
+    };
+
+    parallel_for(n, chunk, do_collapse_inline, &arg);
+
+    uint32_t *first = malloc((n + 1) * sizeof *first);
+    size_t nsites = 0;
+    for (uint32_t fun = 0; fun < n; fun++) {
+        first[fun] = nsites;
+        nsites += arg.count[fun];
+        if (nsites >= UINT32_MAX) die("Too many calls in the graph");
+    }
+    first[n] = nsites;
+
+    fg->callee = realloc(fg->callee, (nsites + 1) * sizeof *fg->callee);
+    fg->line = realloc(fg->line, (nsites + 1) * sizeof *fg->line);
+    fg->column = realloc(fg->column, (nsites + 1) * sizeof *fg->column);
+    fg->weight = realloc(fg->weight, (nsites + 1) * sizeof *fg->weight);
+
+    /* Chunks are concatenated in order */
+    for (size_t i = 0, pos = 0; i < nchunks; i++) {
+        struct site_buffer *buf = &arg.chunks[i];
+        for (size_t j = 0; j < buf->size; j++, pos++) {
+            fg->callee[pos] = buf->data[j].callee;
+            fg->line[pos] = buf->data[j].line;
+            fg->column[pos] = buf->data[j].column;
+            fg->weight[pos] = buf->data[j].weight;
         }
-        ht_erase_current(&it);
-        erase_function(cg, fun);
+        free(buf->data);
     }
+
+    free(fg->out_first);
+    fg->out_first = first;
+    fg->ncalls = nsites;
+
+    remove_frozen_functions(fg, keep);
+
+    for (int i = 0; i < nproc; i++)
+        free(arg.visited[i]);
+    free(arg.visited);
+    free(arg.chunks);
+    free(arg.count);
+    free(keep);
 }
 
-void filter_graph(struct callgraph *cg) {
-    clear_marks(cg);
-    exclude_exceptions(cg);
-    collapse_duplicates(cg);
+void filter_graph(struct frozen_graph *fg) {
+    exclude_exceptions(fg);
+    /* Otherwise calls are already unique */
+    if (config.call_sites) collapse_duplicates(fg);
 
     if (!config.keep_inline || !config.keep_static)
-        collapse_inline(cg, config.keep_inline, config.keep_static);
+        collapse_inline(fg, config.keep_inline, config.keep_static);
 
-    remove_unused(cg);
+    remove_unused(fg);
 
-    if (config.level_of_details == lod_file) {
-        condence_file_graph(cg);
-        collapse_file_duplicates(cg);
-    }
+    if (config.level_of_details == lod_file)
+        condence_file_graph(fg);
 }
@@ -0,0 +1,293 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#include "util.h"
+#include "frozen.h"
+#include "worker.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct frozen_graph *freeze_callgraph(struct callgraph *cg) {
+    struct frozen_graph *fg = calloc(1, sizeof *fg);
+    uint32_t nfiles = fg->nfiles = cg->files.size;
+    uint32_t nfunctions = fg->nfunctions = cg->functions.size;
+    struct function **funs = malloc((nfunctions + 1) * sizeof *funs);
+    size_t ncalls = 0;
+    uint32_t nfun = 0;
+
+    debug("Freezing graph...");
+
+    fg->file_names = malloc((nfiles + 1) * sizeof *fg->file_names);
+    fg->file_first = malloc((nfiles + 1) * sizeof *fg->file_first);
+
+    /* Graph is consumed, so hashes of nodes
+     * are replaced with their indices */
+    uint32_t i = 0;
+    ht_iter_t it = ht_begin(&cg->files);
+    for (ht_head_t *cur; (cur = ht_next(&it)); i++) {
+        struct file *file = container_of(cur, struct file, head);
+        fg->file_names[i] = file->name;
+        fg->file_first[i] = nfun;
+        file->head.hash = i;
+
+        list_iter_t itfun = list_begin(&file->functions);
+        for (list_head_t *curfun; (curfun = list_next(&itfun)); )
+            funs[nfun++] = container_of(curfun, struct function, in_file);
+    }
+    fg->file_first[nfiles] = nfun;
+
+    it = ht_begin(&cg->functions);
+    for (ht_head_t *cur; (cur = ht_next(&it)); ) {
+        struct function *fun = container_of(cur, struct function, head);
+        if (!fun->file) funs[nfun++] = fun;
+    }
+    assert(nfun == nfunctions);
+
+    fg->names = malloc((nfunctions + 1) * sizeof *fg->names);
+    fg->file = malloc((nfunctions + 1) * sizeof *fg->file);
+    fg->flags = malloc(nfunctions + 1);
+    fg->out_first = malloc((nfunctions + 1) * sizeof *fg->out_first);
+
+    for (i = 0; i < nfunctions; i++) {
+        struct function *fun = funs[i];
+        fg->names[i] = fun->name;
+        fg->file[i] = fun->file ? fun->file->head.hash : FROZEN_NONE;
+        fg->flags[i] = (fun->is_definition ? fz_definition : 0) |
+                       (fun->is_extern ? fz_extern : 0) |
+                       (fun->is_inline ? fz_inline : 0);
+        fg->out_first[i] = ncalls;
+        fun->head.hash = i;
+
+        list_iter_t itcall = list_begin(&fun->calls);
+        while (list_next(&itcall)) ncalls++;
+    }
+    fg->out_first[nfunctions] = ncalls;
+
+    if (ncalls >= UINT32_MAX) die("Too many calls in the graph");
+    fg->ncalls = ncalls;
+
+    fg->callee = malloc((ncalls + 1) * sizeof *fg->callee);
+    fg->weight = malloc((ncalls + 1) * sizeof *fg->weight);
+    fg->line = malloc((ncalls + 1) * sizeof *fg->line);
+    fg->column = malloc((ncalls + 1) * sizeof *fg->column);
+
+    for (i = 0; i < nfunctions; i++) {
+        struct function *fun = funs[i];
+        uint32_t e = fg->out_first[i];
+        list_iter_t itcall = list_begin(&fun->calls);
+        for (list_head_t *curcall; (curcall = list_next(&itcall)); e++) {
+            struct call *call = container_of(curcall, struct call, calls);
+            fg->callee[e] = call->callee->head.hash;
+            fg->weight[e] = call->weight;
+            fg->line[e] = call->line;
+            fg->column[e] = call->column;
+        }
+    }
+
+    free(funs);
+    free_callgraph(cg);
+
+    build_frozen_reverse(fg);
+
+    debug("Frozen graph has %"PRIu32" functions, %"PRIu32" files and %"PRIu32" calls",
+          fg->nfunctions, fg->nfiles, fg->ncalls);
+    return fg;
+}
+
+void build_frozen_reverse(struct frozen_graph *fg) {
+    uint32_t n = fg->nfunctions;
+
+    free(fg->in_first);
+    free(fg->caller);
+    free(fg->in_call);
+
+    fg->in_first = calloc(n + 1, sizeof *fg->in_first);
+    fg->caller = malloc((fg->ncalls + 1) * sizeof *fg->caller);
+    fg->in_call = malloc((fg->ncalls + 1) * sizeof *fg->in_call);
+
+    /* Counting sort of calls by callee */
+    for (uint32_t e = 0; e < fg->ncalls; e++)
+        fg->in_first[fg->callee[e] + 1]++;
+    for (uint32_t i = 0; i < n; i++)
+        fg->in_first[i + 1] += fg->in_first[i];
+
+    uint32_t *pos = malloc((n + 1) * sizeof *pos);
+    memcpy(pos, fg->in_first, (n + 1) * sizeof *pos);
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t e = fg->out_first[i]; e < fg->out_first[i + 1]; e++) {
+            uint32_t k = pos[fg->callee[e]]++;
+            fg->caller[k] = i;
+            fg->in_call[k] = e;
+        }
+    }
+    free(pos);
+}
+
+struct move_arg {
+    struct frozen_graph *fg;
+    const uint32_t *first;
+    uint32_t *callee;
+    float *weight;
+    int32_t *line;
+    int32_t *column;
+};
+
+static void do_move_calls(int thread_index, size_t start, size_t end, void *varg) {
+    struct move_arg *arg = varg;
+    struct frozen_graph *fg = arg->fg;
+    (void)thread_index;
+
+    for (size_t i = start; i < end; i++) {
+        uint32_t from = fg->out_first[i], to = arg->first[i];
+        size_t count = arg->first[i + 1] - to;
+        memcpy(arg->callee + to, fg->callee + from, count * sizeof *arg->callee);
+        memcpy(arg->weight + to, fg->weight + from, count * sizeof *arg->weight);
+        memcpy(arg->line + to, fg->line + from, count * sizeof *arg->line);
+        memcpy(arg->column + to, fg->column + from, count * sizeof *arg->column);
+    }
+}
+
+/* Keeps first count[i] calls of every function i */
+void compact_frozen_calls(struct frozen_graph *fg, const uint32_t *count) {
+    uint32_t n = fg->nfunctions;
+    uint32_t *first = malloc((n + 1) * sizeof *first);
+    uint32_t ne = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        first[i] = ne;
+        ne += count[i];
+    }
+    first[n] = ne;
+
+    struct move_arg arg = {
+        .fg = fg,
+        .first = first,
+        .callee = malloc((ne + 1) * sizeof *arg.callee),
+        .weight = malloc((ne + 1) * sizeof *arg.weight),
+        .line = malloc((ne + 1) * sizeof *arg.line),
+        .column = malloc((ne + 1) * sizeof *arg.column),
+    };
+    parallel_for(n, parallel_chunk(n, FROZEN_CHUNK), do_move_calls, &arg);
+
+    free(fg->out_first);
+    free(fg->callee);
+    free(fg->weight);
+    free(fg->line);
+    free(fg->column);
+    fg->out_first = first;
+    fg->callee = arg.callee;
+    fg->weight = arg.weight;
+    fg->line = arg.line;
+    fg->column = arg.column;
+    fg->ncalls = ne;
+}
+
+struct remap_arg {
+    struct frozen_graph *fg;
+    const uint32_t *map;
+    uint32_t *count;
+};
+
+/* Callees are renumbered in place, calls of removed
+ * functions and calls to them are dropped */
+static void do_remap_calls(int thread_index, size_t start, size_t end, void *varg) {
+    struct remap_arg *arg = varg;
+    struct frozen_graph *fg = arg->fg;
+    (void)thread_index;
+
+    for (size_t i = start; i < end; i++) {
+        uint32_t ne = fg->out_first[i];
+        if (arg->map[i] != FROZEN_NONE) {
+            for (uint32_t e = fg->out_first[i]; e < fg->out_first[i + 1]; e++) {
+                uint32_t to = arg->map[fg->callee[e]];
+                if (to == FROZEN_NONE) continue;
+                fg->callee[ne] = to;
+                fg->weight[ne] = fg->weight[e];
+                fg->line[ne] = fg->line[e];
+                fg->column[ne] = fg->column[e];
+                ne++;
+            }
+        }
+        arg->count[i] = ne - fg->out_first[i];
+    }
+}
+
+void remove_frozen_functions(struct frozen_graph *fg, const uint8_t *keep) {
+    uint32_t n = fg->nfunctions;
+    uint32_t *map = malloc((n + 1) * sizeof *map);
+    uint32_t *count = malloc((n + 1) * sizeof *count);
+    uint32_t m = 0;
+
+    for (uint32_t i = 0; i < n; i++)
+        map[i] = keep[i] ? m++ : FROZEN_NONE;
+
+    struct remap_arg arg = { .fg = fg, .map = map, .count = count };
+    parallel_for(n, parallel_chunk(n, FROZEN_CHUNK), do_remap_calls, &arg);
+    compact_frozen_calls(fg, count);
+
+    /* Removed functions have no calls left, so only
+     * functions themselves are compacted, in place,
+     * since new indices are never greater than the old ones */
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t j = map[i];
+        if (j == FROZEN_NONE) continue;
+
+        fg->names[j] = fg->names[i];
+        fg->file[j] = fg->file[i];
+        fg->flags[j] = fg->flags[i];
+        fg->out_first[j] = fg->out_first[i];
+    }
+    fg->out_first[m] = fg->out_first[n];
+
+    /* Functions are still sorted by file */
+    uint32_t kept = 0, i = 0;
+    for (uint32_t f = 0; f <= fg->nfiles; f++) {
+        for (; i < fg->file_first[f]; i++)
+            kept += map[i] != FROZEN_NONE;
+        fg->file_first[f] = kept;
+    }
+
+    fg->nfunctions = m;
+    free(count);
+    free(map);
+
+    build_frozen_reverse(fg);
+}
+
+uint32_t find_frozen_file(struct frozen_graph *fg, const char *name) {
+    const char *str = find_interned(name);
+    for (uint32_t i = 0; str && i < fg->nfiles; i++)
+        if (fg->file_names[i] == str) return i;
+    return FROZEN_NONE;
+}
+
+uint32_t find_frozen_function(struct frozen_graph *fg, const char *name, uint32_t from) {
+    /* Name is not a key in USR mode, so there can be
+     * several matches, this finds the first one from
+     * the given index */
+    const char *str = find_interned(name);
+    for (uint32_t i = from; str && i < fg->nfunctions; i++)
+        if (fg->names[i] == str) return i;
+    return FROZEN_NONE;
+}
+
+void free_frozen_graph(struct frozen_graph *fg) {
+    free(fg->names);
+    free(fg->file);
+    free(fg->flags);
+    free(fg->file_names);
+    free(fg->file_first);
+    free(fg->out_first);
+    free(fg->callee);
+    free(fg->weight);
+    free(fg->line);
+    free(fg->column);
+    free(fg->in_first);
+    free(fg->caller);
+    free(fg->in_call);
+    free(fg->dep_first);
+    free(fg->dep_to);
+    free(fg->dep_weight);
+    free(fg);
+}
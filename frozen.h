@@ -0,0 +1,81 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#ifndef FROZEN_H_
+#define FROZEN_H_ 1
+
+#include "callgraph.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FROZEN_NONE UINT32_MAX
+/* Minimal number of functions processed by one job */
+#define FROZEN_CHUNK 1024
+
+enum frozen_flags {
+    fz_definition = 1 << 0,
+    fz_extern = 1 << 1,
+    fz_inline = 1 << 2,
+};
+
+/* Read-only compressed sparse row form of the graph,
+ * used after parsing is finished.
+ *
+ * Nodes are identified by 32-bit indices. Functions are
+ * sorted by file, so functions of file i are
+ * file_first[i]..file_first[i + 1] - 1, functions
+ * without a file are at the end.
+ * Calls of function i are out_first[i]..out_first[i + 1] - 1
+ * in callee/weight/line/column columns, callers of function i
+ * are in_first[i]..in_first[i + 1] - 1 in caller/in_call,
+ * where in_call is the index of the call in the forward columns.
+ * File level edges are only present after condence_file_graph().
+ * Passes over the graph split functions into chunks of
+ * FROZEN_CHUNK or more, which are processed by worker threads.
+ * Names are interned, so the graph refers to them directly. */
+struct frozen_graph {
+    uint32_t nfunctions;
+    uint32_t nfiles;
+    uint32_t ncalls;
+    uint32_t ndeps;
+
+    /* Functions */
+    const char **names;
+    uint32_t *file;
+    uint8_t *flags;
+
+    /* Files */
+    const char **file_names;
+    uint32_t *file_first;
+
+    /* Forward adjacency */
+    uint32_t *out_first;
+    uint32_t *callee;
+    float *weight;
+    int32_t *line;
+    int32_t *column;
+
+    /* Reverse adjacency */
+    uint32_t *in_first;
+    uint32_t *caller;
+    uint32_t *in_call;
+
+    /* File level graph */
+    uint32_t *dep_first;
+    uint32_t *dep_to;
+    float *dep_weight;
+};
+
+struct frozen_graph *freeze_callgraph(struct callgraph *cg);
+void free_frozen_graph(struct frozen_graph *fg);
+uint32_t find_frozen_file(struct frozen_graph *fg, const char *name);
+uint32_t find_frozen_function(struct frozen_graph *fg, const char *name, uint32_t from);
+void remove_frozen_functions(struct frozen_graph *fg, const uint8_t *keep);
+void compact_frozen_calls(struct frozen_graph *fg, const uint32_t *count);
+void build_frozen_reverse(struct frozen_graph *fg);
+
+void dump_dot(struct frozen_graph *fg, const char *destpath);
+void dump_names(struct frozen_graph *fg, const char *destpath);
+void filter_graph(struct frozen_graph *fg);
+
+#endif
@@ -10,6 +10,10 @@
 #include <string.h>
 
 #define HT_INIT_CAPS 8
+#define HT_LOAD_FACTOR(x) (4*(x)/3)
+#define HT_CAPS_STEP(x) (3*(x)/2)
+/* Number of buckets moved on each change while resizing */
+#define HT_MIGRATE_STEP 4
 
 typedef struct ht_head ht_head_t;
 typedef struct ht_iter ht_iter_t;
@@ -21,11 +25,18 @@ struct ht_head {
     uintptr_t hash;
 };
 
+/* Tables are grown incrementally: after growing, the previous
+ * bucket array is kept in old_data and ht_adjust() moves a few
+ * of its buckets to the new array on every insertion or erasure,
+ * buckets of old_data below moved are already empty */
 struct hashtable {
     ht_cmpfn_t *cmpfn;
     intptr_t caps;
     intptr_t size;
     ht_head_t **data;
+    ht_head_t **old_data;
+    intptr_t old_caps;
+    intptr_t moved;
 };
 
 struct ht_iter {
@@ -36,8 +47,13 @@ struct ht_iter {
 
 extern bool ht_shrink(struct hashtable *ht, intptr_t new_caps);
 extern bool ht_adjust(struct hashtable *ht, intptr_t inc);
+extern bool ht_resize(struct hashtable *ht, intptr_t new_caps);
+extern void ht_migrate(struct hashtable *ht, intptr_t count);
 
 inline static ht_iter_t ht_begin(hashtable_t *ht) {
+    /* Iterators only walk the current bucket array */
+    if (ht->old_data) ht_migrate(ht, ht->old_caps);
+
     ht_iter_t it = { .ht = ht, ht->data, ht->data };
     ht_head_t **end = ht->data + ht->caps;
 
@@ -93,6 +109,7 @@ inline static void ht_free(hashtable_t *ht) {
     assert(!ht->size);
 
     free(ht->data);
+    free(ht->old_data);
     *ht = (hashtable_t){ 0 };
 }
 
@@ -104,8 +121,7 @@ inline static void ht_init(hashtable_t *ht, size_t caps, ht_cmpfn_t *cmpfn) {
     };
 }
 
-inline static ht_head_t **ht_lookup_ptr(hashtable_t *ht, ht_head_t *elem) {
-    ht_head_t **cand = &ht->data[elem->hash % ht->caps];
+inline static ht_head_t **ht_lookup_chain(hashtable_t *ht, ht_head_t **cand, ht_head_t *elem) {
     while (*cand) {
         if (elem->hash == (*cand)->hash &&
             ht->cmpfn(*cand, elem)) break;
@@ -115,6 +131,27 @@ inline static ht_head_t **ht_lookup_ptr(hashtable_t *ht, ht_head_t *elem) {
     return cand;
 }
 
+inline static ht_head_t **ht_lookup_ptr(hashtable_t *ht, ht_head_t *elem) {
+    if (ht->old_data) {
+        /* Element could be not moved yet, new elements
+         * are always inserted into the current array */
+        intptr_t index = elem->hash % ht->old_caps;
+        if (index >= ht->moved) {
+            ht_head_t **cand = ht_lookup_chain(ht, &ht->old_data[index], elem);
+            if (*cand) return cand;
+        }
+    }
+
+    return ht_lookup_chain(ht, &ht->data[elem->hash % ht->caps], elem);
+}
+
+/* Makes room for size elements at once, so that
+ * the table would not be grown while filling it */
+inline static bool ht_reserve(hashtable_t *ht, intptr_t size) {
+    intptr_t caps = HT_LOAD_FACTOR(size);
+    return caps <= ht->caps || ht_resize(ht, caps);
+}
+
 inline static ht_head_t *ht_insert_hint(hashtable_t *ht, ht_head_t **cand, ht_head_t *elem) {
     ht_head_t *old = *cand;
     if (!old) {
@@ -169,14 +206,14 @@ inline static ht_head_t *ht_erase(hashtable_t *ht, ht_head_t *elem) {
 }
 
 // Murmur64A
-inline static uint64_t hash64(const void *vdata, size_t len) {
+inline static uint64_t murmur64_seed(const void *vdata, size_t len, uint64_t seed) {
     const uint64_t m = 0xC6A4A7935BD1E995LLU;
 
 
     const uint64_t *data = (const uint64_t *)vdata;
     const uint64_t *end = data + (len >> 3);
 
-    uint64_t k = 0, h = 123 ^ (len * m);
+    uint64_t k = 0, h = seed ^ (len * m);
     while(data < end) {
         memcpy(&k, data++, sizeof(k));
         k *= m, k ^= k >> 47, k *= m;
@@ -201,6 +238,109 @@ inline static uint64_t hash64(const void *vdata, size_t len) {
     return h;
 }
 
+/* wyhash (final version 4). Long strings are processed 48 bytes
+ * at a time in three independent multiplication lanes, strings up to
+ * 16 bytes are read with at most four overlapping loads, so there
+ * is no byte-by-byte tail */
+inline static void wy_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+inline static uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+inline static uint64_t wy_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+inline static uint64_t wy_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+inline static uint64_t wyhash64_seed(const void *vdata, size_t len, uint64_t seed) {
+    static const uint64_t s[4] = {
+        0x2D358DCCAA6C78A5LLU, 0x8BB84B93962EACC9LLU,
+        0x4B33A62ED433D4A3LLU, 0x4D5A2DA51DE1AA47LLU,
+    };
+
+    const uint8_t *p = (const uint8_t *)vdata;
+    uint64_t a, b;
+
+    seed ^= wy_mix(seed ^ s[0], s[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            a = (wy_read4(p) << 32) | wy_read4(p + off);
+            b = (wy_read4(p + len - 4) << 32) | wy_read4(p + len - 4 - off);
+        } else if (len) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ s[1], wy_read8(p + 8) ^ seed);
+                see1 = wy_mix(wy_read8(p + 16) ^ s[2], wy_read8(p + 24) ^ see1);
+                see2 = wy_mix(wy_read8(p + 32) ^ s[3], wy_read8(p + 40) ^ see2);
+                p += 48, i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_read8(p) ^ s[1], wy_read8(p + 8) ^ seed);
+            p += 16, i -= 16;
+        }
+        a = wy_read8(p + i - 16);
+        b = wy_read8(p + i - 8);
+    }
+
+    a ^= s[1], b ^= seed;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+/* String hash is selected at build time, hashes are
+ * stored in graph files, so they record HASH_ID */
+#ifdef USE_MURMUR
+#define HASH_ID 0
+#else
+#define HASH_ID 1
+#endif
+
+inline static uint64_t hash64_seed(const void *vdata, size_t len, uint64_t seed) {
+#ifdef USE_MURMUR
+    return murmur64_seed(vdata, len, seed);
+#else
+    return wyhash64_seed(vdata, len, seed);
+#endif
+}
+
+inline static uint64_t hash64(const void *vdata, size_t len) {
+    return hash64_seed(vdata, len, 123);
+}
+
 inline static uint64_t uint_hash64(uint64_t h) {
     h ^= h >> 33;
     h *= 0xFF51AFD7ED558CCDUL;
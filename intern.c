@@ -0,0 +1,72 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#include "util.h"
+#include "intern.h"
+#include "swisstable.h"
+#include "list.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define INTERN_STRIPES 64
+
+/* Stripes have separate locks and arenas to reduce contention,
+ * stripe is chosen by the high bits of the hash of the string,
+ * since the low ones are used by the table itself */
+static struct intern_stripe {
+    pthread_mutex_t mtx;
+    struct swisstable ht;
+    struct arena arena;
+} __attribute__((aligned(CACHE_LINE))) pool[INTERN_STRIPES];
+
+static bool eq_interned(const ht_head_t *a, const ht_head_t *b) {
+    const struct interned *ai = container_of(a, const struct interned, head);
+    const struct interned *bi = container_of(b, const struct interned, head);
+    return ai->len == bi->len && !memcmp(ai->str, bi->str, ai->len);
+}
+
+static const char *lookup(const char *str, bool create) {
+    size_t len = strlen(str);
+    struct interned dummy = { .head.hash = hash64(str, len), .str = str, .len = len };
+    struct intern_stripe *stripe = &pool[(dummy.head.hash >> 32) % INTERN_STRIPES];
+    const char *res = NULL;
+
+    pthread_mutex_lock(&stripe->mtx);
+    ht_head_t **h = sw_lookup_ptr(&stripe->ht, &dummy.head);
+    if (*h) {
+        res = container_of(*h, struct interned, head)->str;
+    } else if (create) {
+        struct interned *new = arena_alloc(&stripe->arena, sizeof *new + len + 1);
+        *new = dummy;
+        new->str = res = memcpy(new + 1, str, len + 1);
+        sw_insert_hint(&stripe->ht, h, &new->head);
+    }
+    pthread_mutex_unlock(&stripe->mtx);
+    return res;
+}
+
+const char *intern_string(const char *str) {
+    return lookup(str, 1);
+}
+
+const char *find_interned(const char *str) {
+    return lookup(str, 0);
+}
+
+void init_intern(void) {
+    for (size_t i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_init(&pool[i].mtx, NULL);
+        if (!sw_init(&pool[i].ht, SW_INIT_CAPS, eq_interned))
+            die("Cannot allocate intern pool");
+    }
+}
+
+void fini_intern(void) {
+    for (size_t i = 0; i < INTERN_STRIPES; i++) {
+        /* Entries are owned by the arena */
+        pool[i].ht.size = 0;
+        sw_free(&pool[i].ht);
+        arena_free(&pool[i].arena);
+        pthread_mutex_destroy(&pool[i].mtx);
+    }
+}
@@ -0,0 +1,31 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#ifndef INTERN_H_
+#define INTERN_H_ 1
+
+#include "hashtable.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pool of unique strings shared by all threads.
+ * Equal strings are always interned to the same
+ * pointer, which stays valid until fini_intern(),
+ * so interned strings can be compared by address */
+struct interned {
+    ht_head_t head;
+    const char *str;
+    size_t len;
+};
+
+const char *intern_string(const char *str);
+const char *find_interned(const char *str);
+void init_intern(void);
+void fini_intern(void);
+
+/* Hash of the interned string is stored right before it */
+inline static uint64_t interned_hash(const char *str) {
+    return ((const struct interned *)str - 1)->head.hash;
+}
+
+#endif
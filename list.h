@@ -47,6 +47,16 @@ inline static void list_append(list_head_t *restrict list, list_head_t *restrict
     list->next = elem;
 }
 
+/* Moves all elements of src to the beginning of list */
+inline static void list_splice(list_head_t *restrict list, list_head_t *restrict src) {
+    if (list_is_empty(src)) return;
+    src->prev->next = list->next;
+    list->next->prev = src->prev;
+    list->next = src->next;
+    src->next->prev = list;
+    list_init(src);
+}
+
 inline static list_iter_t list_begin(list_head_t *list) {
     return (list_iter_t) {
         .head = list,
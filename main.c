@@ -1,6 +1,9 @@
 /* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "callgraph.h"
+#include "frozen.h"
 #include "util.h"
 #include "worker.h"
 
@@ -22,7 +25,7 @@ static _Noreturn void usage(const char *argv0, int code) {
     exit(code);
 }
 
-static void parse_options(char **argv) {
+static size_t parse_options(char **argv) {
     size_t ind = 1;
 
     char *arg;
@@ -93,6 +96,20 @@ static void parse_options(char **argv) {
     next:
         if (argv[ind]) ind++;
     }
+
+    return ind;
+}
+
+static void save_partial_graph(struct callgraph *cg, const char *path) {
+    FILE *out = fopen(path, "wb");
+    if (!out) die("Cannot open output file '%s'", path);
+
+    debug("Writing partial graph to '%s'...", path);
+    bool res = save_callgraph(cg, out);
+    if (fclose(out) || !res) {
+        remove(path);
+        die("Cannot write partial graph '%s'", path);
+    }
 }
 
 int main(int argc, char **argv) {
@@ -114,19 +131,44 @@ int main(int argc, char **argv) {
     init_config(cpath);
     /* Parse command line options after config
      * since argv have bigger priority than config file */
-    parse_options(argv);
+    size_t ind = parse_options(argv);
+
+    bool merge = argv[ind] && !strcmp(argv[ind], "merge");
+
+    /* Partial graphs are not dot files,
+     * so they need an explicit name */
+    if (config.shard_count && !merge && !config.output_path)
+        die("Output file is required with --shard");
+    if (!config.output_path) config.output_path = strdup("graph.dot");
 
     /* Initiallize worker threads pool */
     init_workers();
-
-    struct callgraph *cg = parse_directory(config.build_dir);
+    init_intern();
+
+    struct callgraph *cg;
+    if (merge) {
+        /* Combine partial graphs produced by --shard runs */
+        cg = merge_files(argv + ind + 1);
+    } else {
+        if (argv[ind]) usage(argv[0], EXIT_FAILURE);
+        cg = parse_directory(config.build_dir);
+    }
     assert(cg);
 
-    filter_graph(cg);
-    dump_dot(cg, config.output_path);
-    free_callgraph(cg);
+    if (config.shard_count && !merge) {
+        save_partial_graph(cg, config.output_path);
+        free_callgraph(cg);
+    } else {
+        /* The graph is only read and filtered from now on */
+        struct frozen_graph *fg = freeze_callgraph(cg);
+        if (config.names_path) dump_names(fg, config.names_path);
+        filter_graph(fg);
+        dump_dot(fg, config.output_path);
+        free_frozen_graph(fg);
+    }
 
     fini_workers(1);
+    fini_intern();
     fini_config();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,270 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#include "util.h"
+#include "hashtable.h"
+#include "callgraph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GRAPH_MAGIC "LXGRAPH"
+#define GRAPH_VERSION 4
+#define NO_INDEX UINT32_MAX
+/* Name length, file, line, column and flags */
+#define FUNCTION_MIN_SIZE (4 + 4 + 4 + 2 + 1)
+
+enum function_flags {
+    ff_definition = 1 << 0,
+    ff_extern = 1 << 1,
+    ff_inline = 1 << 2,
+};
+
+/* Maps node addresses to their index in the file */
+struct index_entry {
+    ht_head_t head;
+    const void *ptr;
+    uint32_t index;
+};
+
+static bool eq_index(const ht_head_t *a, const ht_head_t *b) {
+    const struct index_entry *ae = container_of(a, const struct index_entry, head);
+    const struct index_entry *be = container_of(b, const struct index_entry, head);
+    return ae->ptr == be->ptr;
+}
+
+static uint32_t find_index(struct hashtable *ht, const void *ptr) {
+    struct index_entry dummy = { .head.hash = uint_hash64((uintptr_t)ptr), .ptr = ptr };
+    ht_head_t *res = ht_find(ht, &dummy.head);
+    return res ? container_of(res, struct index_entry, head)->index : NO_INDEX;
+}
+
+static bool write_string(FILE *out, const char *str) {
+    uint32_t len = strlen(str);
+    return fwrite(&len, sizeof len, 1, out) == 1 &&
+            fwrite(str, 1, len, out) == len;
+}
+
+/* Size of the rest of the stream, which bounds every count read from
+ * it, so that corrupted counts do not cause huge allocations */
+static uint64_t stream_left(FILE *in) {
+    long cur = ftell(in);
+    if (cur < 0 || fseek(in, 0, SEEK_END)) return UINT32_MAX;
+    long end = ftell(in);
+    if (fseek(in, cur, SEEK_SET) || end < cur) return 0;
+    return end - cur;
+}
+
+static char *read_string(FILE *in, char **buf, size_t *caps, uint64_t left) {
+    uint32_t len;
+    if (fread(&len, sizeof len, 1, in) != 1 || len > left) return NULL;
+    if (!adjust_buffer((void **)buf, caps, (size_t)len + 1, 1)) return NULL;
+    if (fread(*buf, 1, len, in) != len) return NULL;
+    (*buf)[len] = '\0';
+    return *buf;
+}
+
+bool save_callgraph(struct callgraph *cg, FILE *out) {
+    struct hashtable index;
+    ht_init(&index, HT_INIT_CAPS, eq_index);
+    struct index_entry *entries = malloc((cg->files.size + cg->functions.size + 1) * sizeof *entries);
+    struct index_entry *next = entries;
+    bool res = 0;
+
+    uint32_t version = GRAPH_VERSION;
+    uint8_t identity = config.function_identity;
+    uint8_t hash = HASH_ID;
+    uint8_t sites = config.call_sites;
+    if (fwrite(GRAPH_MAGIC, sizeof GRAPH_MAGIC, 1, out) != 1) goto e_write;
+    if (fwrite(&version, sizeof version, 1, out) != 1) goto e_write;
+    if (fwrite(&identity, sizeof identity, 1, out) != 1) goto e_write;
+    if (fwrite(&hash, sizeof hash, 1, out) != 1) goto e_write;
+    if (fwrite(&sites, sizeof sites, 1, out) != 1) goto e_write;
+
+    /* Files */
+    uint32_t count = cg->files.size;
+    if (fwrite(&count, sizeof count, 1, out) != 1) goto e_write;
+    count = 0;
+    ht_iter_t it = ht_begin(&cg->files);
+    for (ht_head_t *cur; (cur = ht_next(&it)); count++) {
+        struct file *file = container_of(cur, struct file, head);
+        if (!write_string(out, file->name)) goto e_write;
+        *next = (struct index_entry) { .head.hash = uint_hash64((uintptr_t)file), .ptr = file, .index = count };
+        ht_insert(&index, &next++->head);
+    }
+
+    /* Functions */
+    count = cg->functions.size;
+    if (fwrite(&count, sizeof count, 1, out) != 1) goto e_write;
+    size_t ncalls = 0;
+    count = 0;
+    it = ht_begin(&cg->functions);
+    for (ht_head_t *cur; (cur = ht_next(&it)); count++) {
+        struct function *fun = container_of(cur, struct function, head);
+        if (!write_string(out, fun->name)) goto e_write;
+        struct {
+            uint32_t file;
+            int32_t line;
+            int16_t column;
+            uint8_t flags;
+        } rec = {
+            .file = fun->file ? find_index(&index, fun->file) : NO_INDEX,
+            .line = fun->line,
+            .column = fun->column,
+            .flags = (fun->is_definition ? ff_definition : 0) |
+                     (fun->is_extern ? ff_extern : 0) |
+                     (fun->is_inline ? ff_inline : 0),
+        };
+        if (fwrite(&rec.file, sizeof rec.file, 1, out) != 1 ||
+            fwrite(&rec.line, sizeof rec.line, 1, out) != 1 ||
+            fwrite(&rec.column, sizeof rec.column, 1, out) != 1 ||
+            fwrite(&rec.flags, sizeof rec.flags, 1, out) != 1) goto e_write;
+        if (identity == id_usr) {
+            uint64_t digest[2] = { fun->head.hash, fun->usr };
+            if (fwrite(digest, sizeof digest, 1, out) != 1) goto e_write;
+        }
+
+        *next = (struct index_entry) { .head.hash = uint_hash64((uintptr_t)fun), .ptr = fun, .index = count };
+        ht_insert(&index, &next++->head);
+
+        list_iter_t itcall = list_begin(&fun->calls);
+        while (list_next(&itcall)) ncalls++;
+    }
+
+    /* Calls, each one is reachable from exactly one calls list */
+    count = ncalls;
+    if (fwrite(&count, sizeof count, 1, out) != 1) goto e_write;
+    it = ht_begin(&cg->functions);
+    for (ht_head_t *cur; (cur = ht_next(&it)); ) {
+        struct function *fun = container_of(cur, struct function, head);
+        list_iter_t itcall = list_begin(&fun->calls);
+        for (list_head_t *curcall; (curcall = list_next(&itcall)); ) {
+            struct call *call = container_of(curcall, struct call, calls);
+            uint32_t ends[2] = { find_index(&index, call->caller), find_index(&index, call->callee) };
+            int32_t pos[2] = { call->line, call->column };
+            if (fwrite(ends, sizeof ends, 1, out) != 1 ||
+                fwrite(pos, sizeof pos, 1, out) != 1 ||
+                fwrite(&call->weight, sizeof call->weight, 1, out) != 1) goto e_write;
+        }
+    }
+
+    res = 1;
+e_write:
+    /* Entries are not owned by the table */
+    index.size = 0;
+    ht_free(&index);
+    free(entries);
+    return res;
+}
+
+bool load_callgraph(struct callgraph *dst, FILE *in) {
+    char magic[sizeof GRAPH_MAGIC];
+    uint32_t version, count;
+    uint8_t identity, hash, sites;
+    struct file **files = NULL;
+    struct function **functions = NULL;
+    bool *same_body = NULL;
+    uint32_t nfiles = 0, nfunctions = 0;
+    char *buf = NULL;
+    size_t caps = 0;
+    bool res = 0;
+    uint64_t left = stream_left(in);
+
+    if (fread(magic, sizeof magic, 1, in) != 1 ||
+        memcmp(magic, GRAPH_MAGIC, sizeof magic)) goto e_format;
+    if (fread(&version, sizeof version, 1, in) != 1 ||
+        version != GRAPH_VERSION) goto e_format;
+    if (fread(&identity, sizeof identity, 1, in) != 1) goto e_format;
+    if (identity != config.function_identity) {
+        warn("Graph uses different kind of function identity");
+        goto e_format;
+    }
+    /* Function hashes are stored for USR identity */
+    if (fread(&hash, sizeof hash, 1, in) != 1) goto e_format;
+    if (hash != HASH_ID) {
+        warn("Graph uses different hash function");
+        goto e_format;
+    }
+    if (fread(&sites, sizeof sites, 1, in) != 1) goto e_format;
+    if (sites != config.call_sites) {
+        warn("Graph uses different kind of call edges");
+        goto e_format;
+    }
+
+    /* Files */
+    /* Every file takes at least its name length */
+    if (fread(&nfiles, sizeof nfiles, 1, in) != 1 ||
+        nfiles > left / sizeof(uint32_t)) goto e_format;
+    files = calloc((size_t)nfiles + 1, sizeof *files);
+    if (!files) goto e_format;
+    for (uint32_t i = 0; i < nfiles; i++) {
+        if (!read_string(in, &buf, &caps, left)) goto e_format;
+        files[i] = add_file(dst, buf);
+    }
+
+    /* Functions. Information is merged the same way
+     * as merge_move_callgraph() does it */
+    if (fread(&nfunctions, sizeof nfunctions, 1, in) != 1 ||
+        nfunctions > left / FUNCTION_MIN_SIZE) goto e_format;
+    functions = calloc((size_t)nfunctions + 1, sizeof *functions);
+    same_body = calloc((size_t)nfunctions + 1, sizeof *same_body);
+    if (!functions || !same_body) goto e_format;
+    for (uint32_t i = 0; i < nfunctions; i++) {
+        uint32_t file;
+        int32_t line;
+        int16_t column;
+        uint8_t flags;
+        if (!read_string(in, &buf, &caps, left)) goto e_format;
+        if (fread(&file, sizeof file, 1, in) != 1 ||
+            fread(&line, sizeof line, 1, in) != 1 ||
+            fread(&column, sizeof column, 1, in) != 1 ||
+            fread(&flags, sizeof flags, 1, in) != 1) goto e_format;
+        if (file != NO_INDEX && file >= nfiles) goto e_format;
+
+        struct function key = function_key(buf);
+        if (identity == id_usr) {
+            uint64_t digest[2];
+            if (fread(digest, sizeof digest, 1, in) != 1) goto e_format;
+            key.head.hash = digest[0];
+            key.usr = digest[1];
+        }
+
+        struct function *fun = functions[i] = add_function_ref(dst, &key);
+        /* Calls of a definition which is already in dst are not loaded twice */
+        same_body[i] = fun->is_definition && (flags & ff_definition) && file != NO_INDEX &&
+                fun->file == files[file] && fun->line == line && fun->column == column &&
+                !list_is_empty(&fun->calls);
+        if (!fun->is_definition && file != NO_INDEX) {
+            if (fun->file) list_erase(&fun->in_file);
+            fun->file = files[file];
+            list_append(&fun->file->functions, &fun->in_file);
+            fun->line = line;
+            fun->column = column;
+            fun->is_definition = !!(flags & ff_definition);
+            fun->is_extern = !!(flags & ff_extern);
+            fun->is_inline = !!(flags & ff_inline);
+        }
+    }
+
+    /* Calls */
+    if (fread(&count, sizeof count, 1, in) != 1) goto e_format;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t ends[2];
+        int32_t pos[2];
+        float weight;
+        if (fread(ends, sizeof ends, 1, in) != 1 ||
+            fread(pos, sizeof pos, 1, in) != 1 ||
+            fread(&weight, sizeof weight, 1, in) != 1) goto e_format;
+        if (ends[0] >= nfunctions || ends[1] >= nfunctions) goto e_format;
+        if (!same_body[ends[0]])
+            add_function_call(dst, functions[ends[0]], functions[ends[1]], pos[0], pos[1], weight);
+    }
+
+    res = 1;
+e_format:
+    free(files);
+    free(functions);
+    free(same_body);
+    free(buf);
+    return res;
+}
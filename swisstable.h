@@ -0,0 +1,220 @@
+/* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
+
+#ifndef SWISSTABLE_H_
+#define SWISSTABLE_H_ 1
+
+#include "hashtable.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Open addressing hashtable with the same intrusive interface as
+ * hashtable.h, elements are ht_head_t, but their next field is unused.
+ *
+ * Slots are split into groups of SW_GROUP, and each slot has a control
+ * byte, which is either SW_EMPTY, SW_DELETED or 7 low bits of the hash.
+ * Lookup compares control bytes of the whole group at once and only
+ * touches elements which bytes match, so chains of cold nodes are
+ * never walked. Groups are probed quadratically, starting from the
+ * group chosen by the rest of the hash bits, until a group with
+ * an empty slot is found. */
+
+#define SW_GROUP 16
+#define SW_INIT_CAPS 16
+#define SW_EMPTY ((int8_t)0x80)
+#define SW_DELETED ((int8_t)0xFE)
+/* Maximal number of used (live or deleted) slots is 7/8 of capacity */
+#define SW_LOAD_FACTOR(x) (8*(x)/7)
+
+typedef struct swisstable swisstable_t;
+typedef struct sw_iter sw_iter_t;
+
+struct swisstable {
+    ht_cmpfn_t *cmpfn;
+    size_t caps;
+    size_t size;
+    /* Live and deleted slots */
+    size_t used;
+    int8_t *ctrl;
+    ht_head_t **slots;
+};
+
+struct sw_iter {
+    swisstable_t *sw;
+    size_t index;
+};
+
+extern bool sw_rehash(struct swisstable *sw);
+
+#ifdef __SSE2__
+inline static uint32_t sw_match(const int8_t *group, int8_t tag) {
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+}
+
+inline static uint32_t sw_match_free(const int8_t *group) {
+    /* Empty and deleted slots have high bit set */
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+}
+#else
+inline static uint32_t sw_match(const int8_t *group, int8_t tag) {
+    uint32_t res = 0;
+    for (int i = 0; i < SW_GROUP; i++)
+        res |= (uint32_t)(group[i] == tag) << i;
+    return res;
+}
+
+inline static uint32_t sw_match_free(const int8_t *group) {
+    uint32_t res = 0;
+    for (int i = 0; i < SW_GROUP; i++)
+        res |= (uint32_t)(group[i] < 0) << i;
+    return res;
+}
+#endif
+
+inline static int8_t sw_tag(uintptr_t hash) {
+    return hash & 0x7F;
+}
+
+inline static size_t sw_group(swisstable_t *sw, uintptr_t hash) {
+    return (hash >> 7) & (sw->caps / SW_GROUP - 1);
+}
+
+/* Returns 0 and leaves the table without
+ * any slots if allocation fails */
+inline static bool sw_init(swisstable_t *sw, size_t caps, ht_cmpfn_t *cmpfn) {
+    /* Capacity is a power of two, at least one group */
+    size_t real_caps = SW_INIT_CAPS;
+    while (real_caps < caps) real_caps *= 2;
+
+    *sw = (swisstable_t) {
+        .cmpfn = cmpfn,
+        .caps = real_caps,
+        .ctrl = aligned_alloc(SW_GROUP, real_caps),
+        .slots = calloc(real_caps, sizeof(ht_head_t *)),
+    };
+    if (!sw->ctrl || !sw->slots) {
+        free(sw->ctrl);
+        free(sw->slots);
+        *sw = (swisstable_t) { .cmpfn = cmpfn };
+        return 0;
+    }
+
+    memset(sw->ctrl, SW_EMPTY, real_caps);
+    return 1;
+}
+
+inline static void sw_free(swisstable_t *sw) {
+    /* This function assumes, that all elements was freed before */
+    assert(!sw->size);
+
+    free(sw->ctrl);
+    free(sw->slots);
+    *sw = (swisstable_t){ 0 };
+}
+
+/* Returns the slot containing the element equal to elem,
+ * or the free slot where it should be inserted. There is
+ * always at least one empty slot, so probing terminates */
+inline static ht_head_t **sw_lookup_ptr(swisstable_t *sw, ht_head_t *elem) {
+    size_t mask = sw->caps / SW_GROUP - 1;
+    size_t group = sw_group(sw, elem->hash);
+    int8_t tag = sw_tag(elem->hash);
+    ht_head_t **hint = NULL;
+
+    for (size_t step = 1; ; step++) {
+        const int8_t *ctrl = sw->ctrl + group * SW_GROUP;
+        ht_head_t **slots = sw->slots + group * SW_GROUP;
+
+        for (uint32_t match = sw_match(ctrl, tag); match; match &= match - 1) {
+            ht_head_t **cand = &slots[__builtin_ctz(match)];
+            if (elem->hash == (*cand)->hash && sw->cmpfn(*cand, elem))
+                return cand;
+        }
+
+        uint32_t avail = sw_match_free(ctrl);
+        if (!hint && avail) hint = &slots[__builtin_ctz(avail)];
+        if (sw_match(ctrl, SW_EMPTY)) return hint;
+
+        group = (group + step) & mask;
+    }
+}
+
+inline static ht_head_t *sw_insert_hint(swisstable_t *sw, ht_head_t **cand, ht_head_t *elem) {
+    ht_head_t *old = *cand;
+    if (!old) {
+        size_t index = cand - sw->slots;
+        if (sw->ctrl[index] == SW_EMPTY) sw->used++;
+        sw->ctrl[index] = sw_tag(elem->hash);
+        sw->size++;
+        *cand = elem;
+        /* Lookups only terminate while there are empty slots,
+         * so the table cannot just keep filling up */
+        if (SW_LOAD_FACTOR(sw->used) >= sw->caps && !sw_rehash(sw))
+            die("Cannot grow hashtable");
+    }
+
+    return old;
+}
+
+inline static ht_head_t *sw_erase_hint(swisstable_t *sw, ht_head_t **cand) {
+    ht_head_t *old = *cand;
+    if (old) {
+        size_t index = cand - sw->slots;
+        /* Probing never continues past a group
+         * with empty slots, so no tombstone is needed */
+        bool has_empty = sw_match(sw->ctrl + index / SW_GROUP * SW_GROUP, SW_EMPTY);
+        sw->ctrl[index] = has_empty ? SW_EMPTY : SW_DELETED;
+        if (has_empty) sw->used--;
+        sw->size--;
+        *cand = NULL;
+    }
+    return old;
+}
+
+inline static ht_head_t *sw_find(swisstable_t *sw, ht_head_t *elem) {
+    return *sw_lookup_ptr(sw, elem);
+}
+
+inline static ht_head_t *sw_insert(swisstable_t *sw, ht_head_t *elem) {
+    return sw_insert_hint(sw, sw_lookup_ptr(sw, elem), elem);
+}
+
+inline static ht_head_t *sw_erase(swisstable_t *sw, ht_head_t *elem) {
+    return sw_erase_hint(sw, sw_lookup_ptr(sw, elem));
+}
+
+inline static sw_iter_t sw_begin(swisstable_t *sw) {
+    sw_iter_t it = { .sw = sw };
+    while (it.index < sw->caps && !sw->slots[it.index]) it.index++;
+    return it;
+}
+
+inline static ht_head_t *sw_current(sw_iter_t *it) {
+    return it->index < it->sw->caps ? it->sw->slots[it->index] : NULL;
+}
+
+inline static ht_head_t *sw_next(sw_iter_t *it) {
+    ht_head_t *cur = sw_current(it);
+    if (cur) while (++it->index < it->sw->caps && !it->sw->slots[it->index]);
+    return cur;
+}
+
+inline static ht_head_t *sw_erase_current(sw_iter_t *it) {
+    ht_head_t *cur = sw_current(it);
+    if (cur) {
+        sw_erase_hint(it->sw, &it->sw->slots[it->index]);
+        while (++it->index < it->sw->caps && !it->sw->slots[it->index]);
+    }
+    return cur;
+}
+
+#endif
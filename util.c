@@ -4,6 +4,7 @@
 
 #include "util.h"
 #include "hashtable.h"
+#include "swisstable.h"
 
 #include <ctype.h>
 #include <errno.h>
@@ -31,16 +32,64 @@ static struct options {
     [o_inline] = {"inline", "\t\t(Keep inline functions)"},
     [o_static] = {"static", "\t\t(Keep static functions)"},
     [o_lod] = {"lod", "\t\t(Set level of details, [function]/file)"},
+    [o_identity] = {"identity", "\t\t(What identifies a function, [name]/usr)"},
+    [o_skip_system_headers] = {"skip-system-headers", "\t\t(Do not parse declarations from system headers)"},
+    [o_project_root] = {"project-root", "\t\t(Do not parse declarations from files outside of this directory)"},
+    [o_external_calls] = {"external-calls", "\t\t(Keep calls to skipped functions as leaf nodes)"},
+    [o_shared_preambles] = {"shared-preambles", "\t\t(Precompile leading includes shared by files with the same flags)"},
+    [o_shared_graph] = {"shared-graph", "\t\t(Parse all files into one graph protected by locks instead of merging per-thread graphs)"},
+    [o_huge_pages] = {"huge-pages", "\t\t(Back graph memory with transparent huge pages)"},
+    [o_call_sites] = {"call-sites", "\t\t(Keep every call site as a separate edge until filtering instead of merging calls of the same function)"},
     [o_config] = {"config", ", -C<value>\t(Configuration file path)" },
-    [o_out] = {"out", ", -o<value>\t(Output file path)"},
+    [o_out] = {"out", ", -o<value>\t(Output file path, graph.dot by default, required with --shard)"},
     [o_path] = {"path", ", -p<value>\t(Build directory path)"},
+    [o_processes] = {"processes", "\t\t(Parse files in this many child processes, 0 to parse in threads)"},
+    [o_timeout] = {"timeout", "\t\t(Time limit for parsing one file in a child process in seconds, 0 for no limit)"},
+    [o_memory_limit] = {"memory-limit", "\t\t(Memory limit of a child process in MiB, 0 for no limit)"},
+    [o_retries] = {"retries", "\t\t(Number of times to retry parsing a file after its child process failed)"},
+    [o_shard] = {"shard", "\t\t(Parse only part i/N of the files and write partial graph to the output)"},
+    [o_cache_dir] = {"cache-dir", "\t\t(Directory for the per-file parse cache, disabled by default)"},
+    [o_names_out] = {"names-out", "\t\t(File to write all function and file names to before filtering, one per line)"},
+    [o_reach_out] = {"reach-out", "\t\t(File to write functions reached from each root to, one 'root<TAB>function' per line)"},
     [o_threads] = {"threads", ", -T<value>\t(Number of threads to use, default is number of cores + 1)"},
     [o_exclude_files] = {"exclude-files", "\t\t(List of files to exclude from the graph)"},
     [o_exclude_functions] = {"exclude-functions", "\t\t(List of functions to exclude from the graph)"},
     [o_root_files] = {"root-files", "\t\t(List of files to mark as roots of the graph)"},
     [o_root_functions] = {"root-functions", "\t\t(List of functions to mark as roots of the graph)"},
-    [o_reverse_root_files] = {"reverse-root-files", "\t\t(List of files to mark as reverse_roots of the graph)"},
-    [o_reverse_root_functions] = {"reverse-root-functions", "\t\t(List of functions to mark as reverse_roots of the graph)"},
+    [o_reverse_root_files] = {"reverse-root-files", "\t\t(List of files to mark as reverse roots, whose callers are kept)"},
+    [o_reverse_root_functions] = {"reverse-root-functions", "\t\t(List of functions to mark as reverse roots, whose callers are kept)"},
+    [o_drop_args] = {"drop-args", "\t\t(List of compiler arguments to remove before parsing, 'default' for built-in list)"},
+    [o_add_args] = {"add-args", "\t\t(List of compiler arguments to add before parsing, 'default' for built-in list)"},
+};
+
+/* Built-in argument profile. Nothing of this affects
+ * the call graph, but debug info, warnings, instrumentation
+ * and dependency files make the front-end slower.
+ * Pattern 'X*' matches any argument starting with X,
+ * pattern 'X *' matches X and also removes the argument after it,
+ * pattern '!X' keeps arguments matching X, the first match wins.
+ * Optimization flags are kept since they change predefined
+ * macros and thus the code that gets parsed, so are -Wp options,
+ * which pass macro definitions to the preprocessor. Debug info
+ * options are listed explicitly, since -gcc-toolchain takes
+ * an argument. */
+static const char *default_drop_args[] = {
+    "-g", "-g0", "-g1", "-g2", "-g3", "-ggdb*", "-gdwarf*", "-gsplit-dwarf",
+    "-gline-tables-only", "-gline-directives-only", "-gcolumn-info",
+    "-gstrict-dwarf", "-gz*", "-gno-*", "-grecord-*", "-gstabs*",
+    "-gembed-source", "-gcodeview", "-gbtf", "-gmodules", "-gpubnames",
+    "!-Wp,*", "-W*", "-pg", "-p",
+    "-fsanitize*", "-fno-sanitize*", "-fplugin*",
+    "-fprofile*", "-ftest-coverage", "-fdebug*",
+    "-M", "-MM", "-MD", "-MMD", "-MP", "-MG", "-MV",
+    "-MF *", "-MT *", "-MQ *", "-MF*", "-MT*", "-MQ*",
+    "-save-temps*", "-ftime-report*",
+    NULL
+};
+
+static const char *default_add_args[] = {
+    "-w", "-fsyntax-only",
+    NULL
 };
 
 struct config config;
@@ -116,27 +165,133 @@ bool adjust_buffer(void **buf, size_t *caps, size_t size, size_t elem) {
     return 1;
 }
 
-#define HT_LOAD_FACTOR(x) (4*(x)/3)
-#define HT_CAPS_STEP(x) (3*(x)/2)
+/* Smaller arrays are sorted by insertion, the threshold
+ * is about where radix sort wins in bench/sort */
+#define RADIX_MIN 80
+
+void sort_items(struct sort_item *items, struct sort_item *tmp, size_t n) {
+    if (n < RADIX_MIN) {
+        for (size_t i = 1; i < n; i++) {
+            struct sort_item cur = items[i];
+            size_t j = i;
+            for (; j > 0 && items[j - 1].key > cur.key; j--)
+                items[j] = items[j - 1];
+            items[j] = cur;
+        }
+        return;
+    }
+
+    /* LSD radix sort by bytes, bytes which
+     * are the same in all keys are skipped */
+    uint64_t diff = 0;
+    for (size_t i = 1; i < n; i++)
+        diff |= items[i].key ^ items[0].key;
+
+    struct sort_item *src = items, *dst = tmp;
+    for (int shift = 0; shift < 64; shift += 8) {
+        if (!((diff >> shift) & 0xFF)) continue;
+
+        size_t count[256] = { 0 };
+        for (size_t i = 0; i < n; i++)
+            count[(src[i].key >> shift) & 0xFF]++;
+        for (size_t i = 0, pos = 0; i < 256; i++) {
+            size_t cnt = count[i];
+            count[i] = pos;
+            pos += cnt;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[count[(src[i].key >> shift) & 0xFF]++] = src[i];
+        SWAP(src, dst);
+    }
+
+    if (src != items)
+        memcpy(items, src, n * sizeof *items);
+}
+
+void ht_migrate(struct hashtable *ht, intptr_t count) {
+    while (ht->old_data && count-- > 0) {
+        ht_head_t *cur = ht->old_data[ht->moved];
+        while (cur) {
+            ht_head_t *next = cur->next;
+            ht_head_t **bucket = &ht->data[cur->hash % ht->caps];
+            cur->next = *bucket;
+            *bucket = cur;
+            cur = next;
+        }
+        ht->old_data[ht->moved] = NULL;
+
+        if (++ht->moved == ht->old_caps) {
+            free(ht->old_data);
+            ht->old_data = NULL;
+            ht->old_caps = 0;
+            ht->moved = 0;
+        }
+    }
+}
+
+static bool ht_grow(struct hashtable *ht, intptr_t new_caps) {
+    /* Previous resize is finished first */
+    ht_migrate(ht, ht->old_caps);
+
+    ht_head_t **data = calloc(new_caps, sizeof *data);
+    if (!data) return 0;
+
+    ht->old_data = ht->data;
+    ht->old_caps = ht->caps;
+    ht->moved = 0;
+    ht->data = data;
+    ht->caps = new_caps;
+    return 1;
+}
 
 bool ht_adjust(struct hashtable *ht, intptr_t inc) {
     ht->size += inc;
 
-    if (HT_LOAD_FACTOR(ht->size) > ht->caps) {
-        struct hashtable tmp = {
-            .cmpfn = ht->cmpfn,
-            .caps = HT_CAPS_STEP(ht->caps),
-            .data = calloc(HT_CAPS_STEP(ht->caps), sizeof(*ht->data)),
-        };
-        if (!tmp.data) return 0;
-
-        ht_iter_t it = ht_begin(ht);
-        while(ht_current(&it))
-            ht_insert(&tmp, ht_erase_current(&it));
-        free(ht->data);
-        *ht = tmp;
+    /* Table of x buckets grows to 3x/2 at 3x/4 elements and the
+     * next time at 9x/8 elements, so there are at least 3x/8 changes
+     * in between, which is enough to move x buckets 4 at a time */
+    ht_migrate(ht, HT_MIGRATE_STEP);
+
+    if (HT_LOAD_FACTOR(ht->size) > ht->caps)
+        return ht_grow(ht, HT_CAPS_STEP(ht->caps));
+
+    return 1;
+}
+
+bool ht_resize(struct hashtable *ht, intptr_t new_caps) {
+    if (!ht_grow(ht, new_caps)) return 0;
+    ht_migrate(ht, ht->old_caps);
+    return 1;
+}
+
+bool sw_rehash(struct swisstable *sw) {
+    /* Grow if at least half of the slots are live,
+     * otherwise only get rid of deleted slots */
+    struct swisstable tmp;
+    if (!sw_init(&tmp, 2*sw->size >= sw->caps ? 2*sw->caps : sw->caps, sw->cmpfn))
+        return 0;
+
+    /* Elements are unique, so only free slots are searched for */
+    for (size_t i = 0; i < sw->caps; i++) {
+        ht_head_t *elem = sw->slots[i];
+        if (!elem) continue;
+
+        size_t mask = tmp.caps / SW_GROUP - 1;
+        size_t group = sw_group(&tmp, elem->hash);
+        uint32_t avail;
+        for (size_t step = 1; !(avail = sw_match_free(tmp.ctrl + group * SW_GROUP)); step++)
+            group = (group + step) & mask;
+
+        size_t index = group * SW_GROUP + __builtin_ctz(avail);
+        tmp.ctrl[index] = sw_tag(elem->hash);
+        tmp.slots[index] = elem;
+        tmp.size++;
+        tmp.used++;
     }
 
+    free(sw->ctrl);
+    free(sw->slots);
+    *sw = tmp;
     return 1;
 }
 
@@ -167,6 +322,29 @@ static bool parse_int(const char *str, int64_t *val, int64_t min, int64_t max, i
     return 1;
 }
 
+static bool parse_shard(const char *str, int32_t *index, int32_t *count) {
+    if (!strcasecmp(str, "default")) {
+        *index = *count = 0;
+        return 1;
+    }
+
+    /* Both numbers are plain digits, strtol()
+     * would also accept spaces, signs or nothing */
+    errno = 0;
+    char *end;
+    if (!isdigit((unsigned char)*str)) return 0;
+    long i = strtol(str, &end, 10);
+    if (errno || end == str || *end++ != '/') return 0;
+    if (!isdigit((unsigned char)*end)) return 0;
+    const char *start = end;
+    long n = strtol(start, &end, 10);
+    if (errno || end == start || *end || n <= 0 || n > INT32_MAX || i >= n) return 0;
+
+    *index = i;
+    *count = n;
+    return 1;
+}
+
 static void parse_str(char **dst, const char *str, const char *dflt) {
     char *res;
     if (!strcasecmp(str, "default")) {
@@ -198,6 +376,14 @@ static bool parse_enum(const char *str, int64_t *val, int dflt, int start, ...)
     return 1;
 }
 
+static void append_array_option(struct array_option *current, const char *value) {
+    debug("  Appending option %s", value);
+    bool res = adjust_buffer((void **)&current->data, &current->caps, current->size + 1, sizeof value);
+    assert(res);
+    current->data[current->size++] = strdup(value);
+    assert(current->data[current->size - 1]);
+}
+
 static void fini_array_option(struct array_option *current) {
     for (size_t i = 0; i < current->size; i++)
         free(current->data[i]);
@@ -226,21 +412,81 @@ bool set_option(const char *name, const char *value) {
             if (!parse_bool(value, &bv, 1)) goto e_value;
             config.keep_static = bv;
             return true;
+        } else if (!strcmp(options[o_skip_system_headers].name, name)) {
+            if (!parse_bool(value, &bv, 0)) goto e_value;
+            config.skip_system_headers = bv;
+            return true;
+        } else if (!strcmp(options[o_external_calls].name, name)) {
+            if (!parse_bool(value, &bv, 1)) goto e_value;
+            config.keep_external_calls = bv;
+            return true;
+        } else if (!strcmp(options[o_shared_preambles].name, name)) {
+            if (!parse_bool(value, &bv, 0)) goto e_value;
+            config.shared_preambles = bv;
+            return true;
+        } else if (!strcmp(options[o_shared_graph].name, name)) {
+            if (!parse_bool(value, &bv, 0)) goto e_value;
+            config.shared_graph = bv;
+            return true;
+        } else if (!strcmp(options[o_huge_pages].name, name)) {
+            if (!parse_bool(value, &bv, 0)) goto e_value;
+            config.huge_pages = bv;
+            return true;
+        } else if (!strcmp(options[o_call_sites].name, name)) {
+            if (!parse_bool(value, &bv, 0)) goto e_value;
+            config.call_sites = bv;
+            return true;
+        } else if (!strcmp(options[o_project_root].name, name)) {
+            parse_str(&config.project_root, value, NULL);
+            return true;
         } else if (!strcmp(options[o_path].name, name)) {
             parse_str(&config.build_dir, value, ".");
             return true;
+        } else if (!strcmp(options[o_cache_dir].name, name)) {
+            parse_str(&config.cache_dir, value, NULL);
+            return true;
+        } else if (!strcmp(options[o_names_out].name, name)) {
+            parse_str(&config.names_path, value, NULL);
+            return true;
+        } else if (!strcmp(options[o_reach_out].name, name)) {
+            parse_str(&config.reach_path, value, NULL);
+            return true;
         } else if (!strcmp(options[o_out].name, name)) {
-            parse_str(&config.output_path, value, "graph.dot");
+            parse_str(&config.output_path, value, NULL);
             return true;
         } else if (!strcmp(options[o_threads].name, name)) {
             if (!parse_int(value, &v, 1, 32, 0)) goto e_value;
             config.nthreads = v;
             return true;
+        } else if (!strcmp(options[o_processes].name, name)) {
+            if (!parse_int(value, &v, 0, 1024, 0)) goto e_value;
+            config.nprocesses = v;
+            return true;
+        } else if (!strcmp(options[o_timeout].name, name)) {
+            if (!parse_int(value, &v, 0, INT32_MAX, 0)) goto e_value;
+            config.timeout = v;
+            return true;
+        } else if (!strcmp(options[o_memory_limit].name, name)) {
+            if (!parse_int(value, &v, 0, INT32_MAX, 0)) goto e_value;
+            config.memory_limit = v;
+            return true;
+        } else if (!strcmp(options[o_retries].name, name)) {
+            if (!parse_int(value, &v, 0, 16, 1)) goto e_value;
+            config.retries = v;
+            return true;
+        } else if (!strcmp(options[o_shard].name, name)) {
+            if (!parse_shard(value, &config.shard_index, &config.shard_count)) goto e_value;
+            return true;
         } else if (!strcmp(options[o_lod].name, name)) {
             if (!parse_enum(value, &v, lod_function,
                     lod_function, "function", "file", NULL)) goto e_value;
             config.level_of_details = v;
             return true;
+        } else if (!strcmp(options[o_identity].name, name)) {
+            if (!parse_enum(value, &v, id_name,
+                    id_name, "name", "usr", NULL)) goto e_value;
+            config.function_identity = v;
+            return true;
         } else if (!strcmp(options[o_exclude_files].name, name)) {
             current = &config.exclude_files;
         } else if (!strcmp(options[o_exclude_functions].name, name)) {
@@ -253,19 +499,23 @@ bool set_option(const char *name, const char *value) {
             current = &config.root_functions;
         } else if (!strcmp(options[o_root_files].name, name)) {
             current = &config.root_files;
+        } else if (!strcmp(options[o_drop_args].name, name)) {
+            current = &config.drop_args;
+        } else if (!strcmp(options[o_add_args].name, name)) {
+            current = &config.add_args;
         } else current = NULL;
     }
 
     if (current) {
+        const char **dflt = current == &config.drop_args ? default_drop_args :
+                            current == &config.add_args ? default_add_args : NULL;
         if (!value || !*value) {
             debug("  Clearing option array");
             fini_array_option(current);
+        } else if (dflt && !strcasecmp(value, "default")) {
+            while (*dflt) append_array_option(current, *dflt++);
         } else {
-            debug("  Appending option %s", value);
-            bool res = adjust_buffer((void **)&current->data, &current->caps, current->size + 1, sizeof value);
-            assert(res);
-            current->data[current->size++] = strdup(value);
-            assert(current->data[current->size - 1]);
+            append_array_option(current, value);
         }
         return true;
     }
@@ -281,7 +531,7 @@ const char *usage_string(size_t idx) {
     static char buffer[MAX_OPTION_DESC + 1];
 
     if (!idx) {
-        return /* argv0 here*/ " [options]\n"
+        return /* argv0 here*/ " [options] [merge <partial graph>...]\n"
             "Where options are:\n"
                 "\t--help, -h\t\t\t(Print this message and exit)\n"
                 "\t-q\t\t\t\t(Set log level to 0)\n";
@@ -325,6 +575,64 @@ void unmap_file(struct mapping map) {
     munmap(map.addr, map.size + 1);
 }
 
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+};
+
+static void *map_chunk(size_t size) {
+    if (!config.huge_pages) {
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return addr == MAP_FAILED ? NULL : addr;
+    }
+
+    /* Huge pages need the chunk to be aligned to its size,
+     * so map more memory and trim the ends */
+    char *addr = mmap(NULL, size + ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+
+    char *aligned = (char *)(((uintptr_t)addr + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+    if (aligned > addr) munmap(addr, aligned - addr);
+    munmap(aligned + size, addr + ARENA_CHUNK_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+void *arena_grow(struct arena *arena, size_t size) {
+    size_t header = (sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t chunk_size = MAX(ARENA_CHUNK_SIZE, (header + size + ARENA_CHUNK_SIZE - 1) & ~(ARENA_CHUNK_SIZE - 1));
+
+    struct arena_chunk *chunk = map_chunk(chunk_size);
+    if (!chunk) die("Cannot allocate memory");
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    /* Remaining space of the previous chunk is wasted */
+    char *res = (char *)chunk + header;
+    arena->cur = res + size;
+    arena->end = (char *)chunk + chunk_size;
+    return res;
+}
+
+void arena_adopt(struct arena *dst, struct arena *src) {
+    /* Chunks of src are just appended to the list of dst */
+    struct arena_chunk **tail = &dst->chunks;
+    while (*tail) tail = &(*tail)->next;
+    *tail = src->chunks;
+    *src = (struct arena) { 0 };
+}
+
+void arena_free(struct arena *arena) {
+    for (struct arena_chunk *chunk = arena->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        munmap(chunk, chunk->size);
+    }
+    *arena = (struct arena) { 0 };
+}
+
 #define MAX_VAL_LEN 1024
 
 struct parse_state {
@@ -563,8 +871,14 @@ void fini_config(void) {
     fini_array_option(&config.root_functions);
     fini_array_option(&config.reverse_root_files);
     fini_array_option(&config.reverse_root_functions);
+    fini_array_option(&config.drop_args);
+    fini_array_option(&config.add_args);
     free(config.config_path);
     free(config.output_path);
     free(config.build_dir);
+    free(config.cache_dir);
+    free(config.names_path);
+    free(config.reach_path);
+    free(config.project_root);
     memset(&config, 0, sizeof config);
 }
@@ -35,21 +35,45 @@ enum level_of_details {
     lod_file,
 };
 
+enum function_identity {
+    id_name,
+    id_usr,
+};
+
 struct config {
     char *config_path;
     char *output_path;
     char *build_dir;
+    char *cache_dir;
+    char *names_path;
+    char *reach_path;
+    char *project_root;
     int32_t log_level;
     int32_t level_of_details;
+    int32_t function_identity;
     int32_t nthreads;
+    int32_t nprocesses;
+    int32_t timeout;
+    int32_t memory_limit;
+    int32_t retries;
+    int32_t shard_index;
+    int32_t shard_count;
     struct array_option exclude_files;
     struct array_option exclude_functions;
     struct array_option root_files;
     struct array_option root_functions;
     struct array_option reverse_root_files;
     struct array_option reverse_root_functions;
+    struct array_option drop_args;
+    struct array_option add_args;
     bool keep_inline;
     bool keep_static;
+    bool skip_system_headers;
+    bool keep_external_calls;
+    bool shared_preambles;
+    bool shared_graph;
+    bool huge_pages;
+    bool call_sites;
 };
 
 extern struct config config;
@@ -69,6 +93,24 @@ enum option {
     o_reverse_root_files,
     o_reverse_root_functions,
     o_lod,
+    o_cache_dir,
+    o_processes,
+    o_timeout,
+    o_memory_limit,
+    o_retries,
+    o_shard,
+    o_identity,
+    o_skip_system_headers,
+    o_project_root,
+    o_external_calls,
+    o_drop_args,
+    o_add_args,
+    o_shared_preambles,
+    o_shared_graph,
+    o_huge_pages,
+    o_names_out,
+    o_reach_out,
+    o_call_sites,
     o_MAX
 };
 
@@ -88,5 +130,44 @@ struct mapping map_file(const char *path);
 void unmap_file(struct mapping map);
 bool adjust_buffer(void **buf, size_t *caps, size_t size, size_t elem);
 
+/* Stable sort of items by key, instead of comparing
+ * complex records with qsort() they are packed into
+ * keys, value is usually the index of the record.
+ * tmp should have space for n items */
+
+struct sort_item {
+    uint64_t key;
+    uint32_t value;
+};
+
+void sort_items(struct sort_item *items, struct sort_item *tmp, size_t n);
+
+/* Arena allocator. Memory is returned zeroed and
+ * is only released all at once by arena_free() */
+
+#define ARENA_CHUNK_SIZE (2LU << 20)
+#define ARENA_ALIGN 16
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *chunks;
+    char *cur;
+    char *end;
+};
+
+void *arena_grow(struct arena *arena, size_t size);
+void arena_adopt(struct arena *dst, struct arena *src);
+void arena_free(struct arena *arena);
+
+inline static void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if ((size_t)(arena->end - arena->cur) < size)
+        return arena_grow(arena, size);
+    void *res = arena->cur;
+    arena->cur += size;
+    return res;
+}
+
 #endif
 
@@ -14,6 +14,8 @@
 
 #define MAX_THREADS 32
 #define STORAGE_SIZE 65536
+/* Few chunks per thread to even out the load */
+#define CHUNKS_PER_THREAD 8
 
 
 struct job {
@@ -164,3 +166,28 @@ void fini_workers(_Bool force) {
 
     free(storage_start);
 }
+
+struct range_arg {
+    range_func_t *func;
+    void *data;
+    size_t start;
+    size_t end;
+};
+
+static void do_range(int thread_index, void *varg) {
+    struct range_arg *arg = varg;
+    arg->func(thread_index, arg->start, arg->end, arg->data);
+}
+
+size_t parallel_chunk(size_t n, size_t min_chunk) {
+    size_t chunks = (size_t)nproc * CHUNKS_PER_THREAD;
+    return MAX(min_chunk, (n + chunks - 1) / chunks);
+}
+
+void parallel_for(size_t n, size_t chunk, range_func_t *func, void *data) {
+    for (size_t start = 0; start < n; start += chunk) {
+        struct range_arg arg = { func, data, start, MIN(start + chunk, n) };
+        submit_work(do_range, &arg, sizeof arg);
+    }
+    drain_work();
+}
@@ -10,6 +10,13 @@ void init_workers(void);
 void drain_work(void);
 void fini_workers(_Bool force);
 
+/* Items [0, n) are split into chunks of the given size,
+ * func is called for each chunk on the worker threads
+ * with the range of items, the call waits for all of them */
+typedef void range_func_t(int thread_index, size_t start, size_t end, void *data);
+size_t parallel_chunk(size_t n, size_t min_chunk);
+void parallel_for(size_t n, size_t chunk, range_func_t *func, void *data);
+
 extern int nproc;
 
 #endif